@@ -1,3 +1,14 @@
 #!/bin/bash
 
-gcc sdlvideoviewer.c -o testx86 -lm -std=c99 -lSDL
+gcc -O2 -std=c99 -c capture.c -o capture.o
+gcc -O2 -std=c99 -c util.c -o util.o
+ar rcs libcapture.a capture.o util.o
+
+gcc -O2 sdlvideoviewer.c convert.c perfcounters.c snapshot.c prering.c deinterlace.c framestats.c filterchain.c denoise.c -o testx86 -lm -std=c99 -L. -lcapture -lSDL -lpthread -lpng -ljpeg -lz
+
+# Kernel self test, no SDL needed; ./build.sh test also runs it
+gcc -O2 selftest.c convert.c deinterlace.c denoise.c framestats.c util.c -o selftest -lm -std=c99 -lpthread || exit 1
+
+if [ "$1" = "test" ]; then
+    ./selftest || exit 1
+fi
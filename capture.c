@@ -0,0 +1,877 @@
+/*
+ * V4L2 capture library.
+ *
+ * Based on the V4L2 video capture example, like the viewer it came from.
+ * Each handle owns its device, buffers and optional capture thread, so
+ * several devices can be used from one process.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <fcntl.h>              /* low-level i/o */
+#include <unistd.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include <asm/types.h>          /* for videodev2.h */
+
+#include <linux/videodev2.h>
+
+#include "capture.h"
+#include "util.h"
+
+#define CLEAR(x) memset (&(x), 0, sizeof (x))
+
+struct buffer
+{
+    void *start;
+    size_t length;
+};
+
+struct capture
+{
+    char *dev_name;
+    capture_io io;
+    int fd;
+    uint32_t capabilities;
+    struct v4l2_pix_format fmt;
+    struct buffer *buffers;
+    unsigned int n_buffers;
+    int streaming;
+
+    /* capture_start_async() */
+    pthread_t thread;
+    int async;
+    int wake[2];
+    capture_callback callback;
+    void *user;
+};
+
+static int errno_report(const capture * cap, const char *s)
+{
+    fprintf(stderr, "%s: %s error %d, %s\n", cap->dev_name, s, errno, strerror(errno));
+
+    return -1;
+}
+
+static int xioctl(int fd, int request, void *arg)
+{
+    int r;
+
+    do
+    {
+        r = ioctl(fd, request, arg);
+    }
+    while (-1 == r && EINTR == errno);
+
+    return r;
+}
+
+static int open_device(capture * cap)
+{
+    struct stat st;
+
+    if (-1 == stat(cap->dev_name, &st))
+    {
+        fprintf(stderr, "Cannot identify '%s': %d, %s\n",
+                cap->dev_name, errno, strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISCHR(st.st_mode))
+    {
+        fprintf(stderr, "%s is no device\n", cap->dev_name);
+        return -1;
+    }
+
+    cap->fd = open(cap->dev_name, O_RDWR /* required */  | O_NONBLOCK, 0);
+
+    if (-1 == cap->fd)
+    {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                cap->dev_name, errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int init_read(capture * cap, unsigned int buffer_size)
+{
+    cap->buffers = calloc(1, sizeof(*cap->buffers));
+
+    if (!cap->buffers)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    cap->buffers[0].length = buffer_size;
+    cap->buffers[0].start = malloc(buffer_size);
+
+    if (!cap->buffers[0].start)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    cap->n_buffers = 1;
+
+    return 0;
+}
+
+static int init_mmap(capture * cap, unsigned int count)
+{
+    struct v4l2_requestbuffers req;
+
+    CLEAR(req);
+
+    req.count = count;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+
+    if (-1 == xioctl(cap->fd, VIDIOC_REQBUFS, &req))
+    {
+        if (EINVAL == errno)
+        {
+            fprintf(stderr, "%s does not support "
+                    "memory mapping\n", cap->dev_name);
+            return -1;
+        }
+        else
+        {
+            return errno_report(cap, "VIDIOC_REQBUFS");
+        }
+    }
+
+    if (req.count < 2)
+    {
+        fprintf(stderr, "Insufficient buffer memory on %s\n", cap->dev_name);
+        return -1;
+    }
+
+    cap->buffers = calloc(req.count, sizeof(*cap->buffers));
+
+    if (!cap->buffers)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    for (cap->n_buffers = 0; cap->n_buffers < req.count; ++cap->n_buffers)
+    {
+        struct v4l2_buffer buf;
+        struct buffer *b = &cap->buffers[cap->n_buffers];
+
+        CLEAR(buf);
+
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = cap->n_buffers;
+
+        if (-1 == xioctl(cap->fd, VIDIOC_QUERYBUF, &buf))
+            return errno_report(cap, "VIDIOC_QUERYBUF");
+
+        b->length = buf.length;
+        b->start = mmap(NULL /* start anywhere */ ,
+                        buf.length, PROT_READ | PROT_WRITE /* required */ ,
+                        MAP_SHARED /* recommended */ ,
+                        cap->fd, buf.m.offset);
+
+        if (MAP_FAILED == b->start)
+        {
+            b->start = NULL;
+            return errno_report(cap, "mmap");
+        }
+    }
+
+    return 0;
+}
+
+static int init_userp(capture * cap, unsigned int buffer_size, unsigned int count)
+{
+    struct v4l2_requestbuffers req;
+    unsigned int page_size;
+
+    page_size = getpagesize();
+    buffer_size = (buffer_size + page_size - 1) & ~(page_size - 1);
+
+    CLEAR(req);
+
+    req.count = count;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_USERPTR;
+
+    if (-1 == xioctl(cap->fd, VIDIOC_REQBUFS, &req))
+    {
+        if (EINVAL == errno)
+        {
+            fprintf(stderr, "%s does not support "
+                    "user pointer i/o\n", cap->dev_name);
+            return -1;
+        }
+        else
+        {
+            return errno_report(cap, "VIDIOC_REQBUFS");
+        }
+    }
+
+    cap->buffers = calloc(count, sizeof(*cap->buffers));
+
+    if (!cap->buffers)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    for (cap->n_buffers = 0; cap->n_buffers < count; ++cap->n_buffers)
+    {
+        struct buffer *b = &cap->buffers[cap->n_buffers];
+
+        b->length = buffer_size;
+        b->start = memalign( /* boundary */ page_size, buffer_size);
+
+        if (!b->start)
+        {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Negotiates the format and sets up buffers for cap->io. The device must
+ * not be streaming and hold no buffers.
+ */
+static int init_format(capture * cap, const struct capture_config *config)
+{
+    struct v4l2_format fmt;
+    unsigned int count = config->n_buffers ? config->n_buffers : 4;
+    unsigned int min;
+
+    switch (cap->io)
+    {
+    case CAPTURE_IO_READ:
+        if (!(cap->capabilities & V4L2_CAP_READWRITE))
+        {
+            fprintf(stderr, "%s does not support read i/o\n", cap->dev_name);
+            return -1;
+        }
+
+        break;
+
+    case CAPTURE_IO_MMAP:
+    case CAPTURE_IO_USERPTR:
+        if (!(cap->capabilities & V4L2_CAP_STREAMING))
+        {
+            fprintf(stderr, "%s does not support streaming i/o\n", cap->dev_name);
+            return -1;
+        }
+
+        break;
+    }
+
+    CLEAR(fmt);
+
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = config->width;
+    fmt.fmt.pix.height = config->height;
+    fmt.fmt.pix.pixelformat = config->pixelformat;
+    fmt.fmt.pix.field = config->field;
+
+    if (-1 == xioctl(cap->fd, VIDIOC_S_FMT, &fmt))
+        return errno_report(cap, "VIDIOC_S_FMT");
+
+    /* Note VIDIOC_S_FMT may change width and height. */
+
+    /* Buggy driver paranoia. */
+    min = fmt.fmt.pix.width * 2;
+    if (fmt.fmt.pix.bytesperline < min)
+        fmt.fmt.pix.bytesperline = min;
+    min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+    if (fmt.fmt.pix.sizeimage < min)
+        fmt.fmt.pix.sizeimage = min;
+
+    cap->fmt = fmt.fmt.pix;
+
+    switch (cap->io)
+    {
+    case CAPTURE_IO_READ:
+        return init_read(cap, fmt.fmt.pix.sizeimage);
+
+    case CAPTURE_IO_MMAP:
+        return init_mmap(cap, count);
+
+    case CAPTURE_IO_USERPTR:
+        return init_userp(cap, fmt.fmt.pix.sizeimage, count);
+    }
+
+    return -1;
+}
+
+static int init_device(capture * cap, const struct capture_config *config)
+{
+    struct v4l2_capability cap_info;
+    struct v4l2_cropcap cropcap;
+    struct v4l2_crop crop;
+
+    if (-1 == xioctl(cap->fd, VIDIOC_QUERYCAP, &cap_info))
+    {
+        if (EINVAL == errno)
+        {
+            fprintf(stderr, "%s is no V4L2 device\n", cap->dev_name);
+            return -1;
+        }
+        else
+        {
+            return errno_report(cap, "VIDIOC_QUERYCAP");
+        }
+    }
+
+    if (!(cap_info.capabilities & V4L2_CAP_VIDEO_CAPTURE))
+    {
+        fprintf(stderr, "%s is no video capture device\n", cap->dev_name);
+        return -1;
+    }
+
+    cap->capabilities = cap_info.capabilities;
+
+
+    /* Select video input, video standard and tune here. */
+
+
+    CLEAR(cropcap);
+
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (0 == xioctl(cap->fd, VIDIOC_CROPCAP, &cropcap))
+    {
+        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        crop.c = cropcap.defrect;   /* reset to default */
+
+        /* Errors ignored, cropping may not be supported. */
+        xioctl(cap->fd, VIDIOC_S_CROP, &crop);
+    }
+    else
+    {
+        /* Errors ignored. */
+    }
+
+
+    return init_format(cap, config);
+}
+
+static void uninit_device(capture * cap)
+{
+    struct v4l2_requestbuffers req;
+    unsigned int i;
+
+    if (!cap->buffers)
+        return;
+
+    switch (cap->io)
+    {
+    case CAPTURE_IO_READ:
+        free(cap->buffers[0].start);
+        break;
+
+    case CAPTURE_IO_MMAP:
+        for (i = 0; i < cap->n_buffers; ++i)
+            if (-1 == munmap(cap->buffers[i].start, cap->buffers[i].length))
+                errno_report(cap, "munmap");
+        break;
+
+    case CAPTURE_IO_USERPTR:
+        for (i = 0; i < cap->n_buffers; ++i)
+            free(cap->buffers[i].start);
+        break;
+    }
+
+    free(cap->buffers);
+
+    cap->buffers = NULL;
+    cap->n_buffers = 0;
+
+    /* Let the driver drop its buffers too, or S_FMT may refuse a new size. */
+    if (cap->io != CAPTURE_IO_READ)
+    {
+        CLEAR(req);
+
+        req.count = 0;
+        req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        req.memory = cap->io == CAPTURE_IO_MMAP ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+
+        /* Errors ignored, old drivers do not support freeing. */
+        xioctl(cap->fd, VIDIOC_REQBUFS, &req);
+    }
+}
+
+capture *capture_open(const struct capture_config *config)
+{
+    capture *cap;
+
+    cap = calloc(1, sizeof(*cap));
+    if (!cap)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+
+    cap->dev_name = strdup(config->dev_name);
+    cap->io = config->io;
+    cap->fd = -1;
+    cap->wake[0] = -1;
+    cap->wake[1] = -1;
+
+    if (!cap->dev_name || -1 == open_device(cap) || -1 == init_device(cap, config))
+    {
+        capture_close(cap);
+        return NULL;
+    }
+
+    return cap;
+}
+
+void capture_close(capture * cap)
+{
+    if (!cap)
+        return;
+
+    if (cap->async)
+        capture_stop_async(cap);
+    else if (cap->streaming)
+        capture_stop(cap);
+
+    uninit_device(cap);
+
+    if (-1 != cap->fd && -1 == close(cap->fd))
+        errno_report(cap, "close");
+
+    free(cap->dev_name);
+    free(cap);
+}
+
+int capture_reconfigure(capture * cap, const struct capture_config *config)
+{
+    int streaming = cap->streaming;
+
+    if (cap->async)
+    {
+        fprintf(stderr, "%s: stop asynchronous capture before reconfiguring\n",
+                cap->dev_name);
+        return -1;
+    }
+
+    if (streaming && -1 == capture_stop(cap))
+        return -1;
+
+    uninit_device(cap);
+
+    cap->io = config->io;
+
+    if (-1 == init_format(cap, config))
+        return -1;
+
+    if (streaming)
+        return capture_start(cap);
+
+    return 0;
+}
+
+int capture_supports(const capture * cap, capture_io io)
+{
+    switch (io)
+    {
+    case CAPTURE_IO_READ:
+        return !!(cap->capabilities & V4L2_CAP_READWRITE);
+
+    case CAPTURE_IO_MMAP:
+    case CAPTURE_IO_USERPTR:
+        return !!(cap->capabilities & V4L2_CAP_STREAMING);
+    }
+
+    return 0;
+}
+
+const struct v4l2_pix_format *capture_format(const capture * cap)
+{
+    return &cap->fmt;
+}
+
+int capture_fd(const capture * cap)
+{
+    return cap->fd;
+}
+
+int capture_start(capture * cap)
+{
+    unsigned int i;
+    enum v4l2_buf_type type;
+
+    switch (cap->io)
+    {
+    case CAPTURE_IO_READ:
+        /* Nothing to do. */
+        break;
+
+    case CAPTURE_IO_MMAP:
+        for (i = 0; i < cap->n_buffers; ++i)
+        {
+            struct v4l2_buffer buf;
+
+            CLEAR(buf);
+
+            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buf.memory = V4L2_MEMORY_MMAP;
+            buf.index = i;
+
+            if (-1 == xioctl(cap->fd, VIDIOC_QBUF, &buf))
+                return errno_report(cap, "VIDIOC_QBUF");
+        }
+
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+        if (-1 == xioctl(cap->fd, VIDIOC_STREAMON, &type))
+            return errno_report(cap, "VIDIOC_STREAMON");
+
+        break;
+
+    case CAPTURE_IO_USERPTR:
+        for (i = 0; i < cap->n_buffers; ++i)
+        {
+            struct v4l2_buffer buf;
+
+            CLEAR(buf);
+
+            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buf.memory = V4L2_MEMORY_USERPTR;
+            buf.index = i;
+            buf.m.userptr = (unsigned long)cap->buffers[i].start;
+            buf.length = cap->buffers[i].length;
+
+            if (-1 == xioctl(cap->fd, VIDIOC_QBUF, &buf))
+                return errno_report(cap, "VIDIOC_QBUF");
+        }
+
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+        if (-1 == xioctl(cap->fd, VIDIOC_STREAMON, &type))
+            return errno_report(cap, "VIDIOC_STREAMON");
+
+        break;
+    }
+
+    cap->streaming = 1;
+
+    return 0;
+}
+
+int capture_stop(capture * cap)
+{
+    enum v4l2_buf_type type;
+
+    cap->streaming = 0;
+
+    switch (cap->io)
+    {
+    case CAPTURE_IO_READ:
+        /* Nothing to do. */
+        break;
+
+    case CAPTURE_IO_MMAP:
+    case CAPTURE_IO_USERPTR:
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+        if (-1 == xioctl(cap->fd, VIDIOC_STREAMOFF, &type))
+            return errno_report(cap, "VIDIOC_STREAMOFF");
+
+        break;
+    }
+
+    return 0;
+}
+
+static void fill_frame(const capture * cap, struct capture_frame *frame,
+                       const void *data, const struct v4l2_buffer *buf)
+{
+    frame->data = data;
+    frame->width = cap->fmt.width;
+    frame->height = cap->fmt.height;
+    frame->stride = cap->fmt.bytesperline;
+    frame->pixelformat = cap->fmt.pixelformat;
+    frame->bytesused = buf->bytesused;
+    frame->field = buf->field;
+    frame->timestamp = buf->timestamp;
+    frame->sequence = buf->sequence;
+    frame->index = buf->index;
+}
+
+int capture_borrow(capture * cap, struct capture_frame *frame)
+{
+    struct v4l2_buffer buf;
+    unsigned int i;
+    ssize_t r;
+
+    CLEAR(buf);
+
+    switch (cap->io)
+    {
+    case CAPTURE_IO_READ:
+        r = read(cap->fd, cap->buffers[0].start, cap->buffers[0].length);
+
+        if (-1 == r)
+        {
+            switch (errno)
+            {
+            case EAGAIN:
+                return 0;
+
+            case EIO:
+                /* Could ignore EIO, see spec. */
+
+                /* fall through */
+
+            default:
+                return errno_report(cap, "read");
+            }
+        }
+
+        /* read() carries no metadata, make up what we can. */
+        buf.bytesused = r;
+        buf.field = V4L2_FIELD_ANY;
+        gettimeofday(&buf.timestamp, NULL);
+
+        fill_frame(cap, frame, cap->buffers[0].start, &buf);
+
+        break;
+
+    case CAPTURE_IO_MMAP:
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+
+        if (-1 == xioctl(cap->fd, VIDIOC_DQBUF, &buf))
+        {
+            switch (errno)
+            {
+            case EAGAIN:
+                return 0;
+
+            case EIO:
+                /* Could ignore EIO, see spec. */
+
+                /* fall through */
+
+            default:
+                return errno_report(cap, "VIDIOC_DQBUF");
+            }
+        }
+
+        assert(buf.index < cap->n_buffers);
+
+        fill_frame(cap, frame, cap->buffers[buf.index].start, &buf);
+
+        break;
+
+    case CAPTURE_IO_USERPTR:
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_USERPTR;
+
+        if (-1 == xioctl(cap->fd, VIDIOC_DQBUF, &buf))
+        {
+            switch (errno)
+            {
+            case EAGAIN:
+                return 0;
+
+            case EIO:
+                /* Could ignore EIO, see spec. */
+
+                /* fall through */
+
+            default:
+                return errno_report(cap, "VIDIOC_DQBUF");
+            }
+        }
+
+        for (i = 0; i < cap->n_buffers; ++i)
+            if (buf.m.userptr == (unsigned long)cap->buffers[i].start
+                && buf.length == cap->buffers[i].length)
+                break;
+
+        assert(i < cap->n_buffers);
+
+        /* The driver's index is meaningless here, remember ours. */
+        buf.index = i;
+        fill_frame(cap, frame, (void *)buf.m.userptr, &buf);
+
+        break;
+    }
+
+    return 1;
+}
+
+int capture_release(capture * cap, const struct capture_frame *frame)
+{
+    struct v4l2_buffer buf;
+
+    CLEAR(buf);
+
+    switch (cap->io)
+    {
+    case CAPTURE_IO_READ:
+        /* Nothing to do. */
+        break;
+
+    case CAPTURE_IO_MMAP:
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = frame->index;
+
+        if (-1 == xioctl(cap->fd, VIDIOC_QBUF, &buf))
+            return errno_report(cap, "VIDIOC_QBUF");
+
+        break;
+
+    case CAPTURE_IO_USERPTR:
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_USERPTR;
+        buf.index = frame->index;
+        buf.m.userptr = (unsigned long)cap->buffers[frame->index].start;
+        buf.length = cap->buffers[frame->index].length;
+
+        if (-1 == xioctl(cap->fd, VIDIOC_QBUF, &buf))
+            return errno_report(cap, "VIDIOC_QBUF");
+
+        break;
+    }
+
+    return 0;
+}
+
+static void *async_thread(void *arg)
+{
+    capture *cap = arg;
+    struct capture_frame frame;
+    int nfds = (cap->fd > cap->wake[0] ? cap->fd : cap->wake[0]) + 1;
+
+    for (;;)
+    {
+        fd_set fds;
+        struct timeval tv;
+        int r;
+
+        FD_ZERO(&fds);
+        FD_SET(cap->fd, &fds);
+        FD_SET(cap->wake[0], &fds);
+
+        /* Timeout. */
+        tv.tv_sec = 2;
+        tv.tv_usec = 0;
+
+        r = select(nfds, &fds, NULL, NULL, &tv);
+
+        if (-1 == r)
+        {
+            if (EINTR == errno)
+                continue;
+
+            errno_report(cap, "select");
+            break;
+        }
+
+        if (0 == r)
+        {
+            fprintf(stderr, "%s: select timeout\n", cap->dev_name);
+            break;
+        }
+
+        if (FD_ISSET(cap->wake[0], &fds))
+            return NULL;
+
+        r = capture_borrow(cap, &frame);
+
+        if (-1 == r)
+            break;
+
+        if (0 == r)
+            continue;           /* EAGAIN - continue select loop. */
+
+        cap->callback(&frame, cap->user);
+
+        if (-1 == capture_release(cap, &frame))
+            break;
+    }
+
+    cap->callback(NULL, cap->user);
+
+    return NULL;
+}
+
+int capture_start_async(capture * cap, capture_callback callback, void *user)
+{
+
+    if (-1 == pipe(cap->wake))
+        return errno_report(cap, "pipe");
+
+    if (-1 == capture_start(cap))
+        goto fail;
+
+    cap->callback = callback;
+    cap->user = user;
+
+    /* Leave signal handling to the application's own threads. */
+    if (start_worker(&cap->thread, async_thread, cap))
+    {
+        fprintf(stderr, "%s: cannot start capture thread\n", cap->dev_name);
+        capture_stop(cap);
+        goto fail;
+    }
+
+    cap->async = 1;
+
+    return 0;
+
+fail:
+    close(cap->wake[0]);
+    close(cap->wake[1]);
+    cap->wake[0] = -1;
+    cap->wake[1] = -1;
+
+    return -1;
+}
+
+int capture_stop_async(capture * cap)
+{
+    char c = 0;
+
+    if (!cap->async)
+        return 0;
+
+    if (-1 == write(cap->wake[1], &c, 1))
+        errno_report(cap, "write");
+
+    pthread_join(cap->thread, NULL);
+
+    close(cap->wake[0]);
+    close(cap->wake[1]);
+    cap->wake[0] = -1;
+    cap->wake[1] = -1;
+    cap->async = 0;
+
+    return capture_stop(cap);
+}
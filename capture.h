@@ -0,0 +1,120 @@
+/*
+ * V4L2 capture library.
+ *
+ * Device handling taken out of the SDL viewer so other programs can use
+ * it: each open device is an opaque handle, frames are borrowed straight
+ * from the driver's buffers and given back with capture_release().
+ *
+ * Synchronous use:
+ *
+ *   cap = capture_open(&config);
+ *   capture_start(cap);
+ *   for (;;)
+ *   {
+ *       wait until capture_fd(cap) is readable;
+ *       if (capture_borrow(cap, &frame) == 1)
+ *       {
+ *           use frame.data;
+ *           capture_release(cap, &frame);
+ *       }
+ *   }
+ *   capture_stop(cap);
+ *   capture_close(cap);
+ *
+ * Or let capture_start_async() run that loop on its own thread and call
+ * back for every frame.
+ *
+ * Functions report problems on stderr and return -1 (NULL for
+ * capture_open()); they never exit the process.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <linux/videodev2.h>
+
+typedef enum
+{
+    CAPTURE_IO_READ,
+    CAPTURE_IO_MMAP,
+    CAPTURE_IO_USERPTR,
+} capture_io;
+
+struct capture_config
+{
+    const char *dev_name;
+    capture_io io;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixelformat;       /* V4L2_PIX_FMT_* */
+    enum v4l2_field field;
+    unsigned int n_buffers;     /* 0 for the default of 4 */
+};
+
+struct capture_frame
+{
+    const void *data;           /* valid until capture_release() */
+    size_t bytesused;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;            /* bytes per line */
+    uint32_t pixelformat;
+    enum v4l2_field field;
+    struct timeval timestamp;
+    uint32_t sequence;
+
+    /* Private, identifies the driver buffer. */
+    unsigned int index;
+};
+
+typedef struct capture capture;
+
+/*
+ * Called from the capture thread for every frame, which is released as
+ * soon as the callback returns. A NULL frame means capture failed and the
+ * thread has stopped.
+ */
+typedef void (*capture_callback) (const struct capture_frame * frame,
+                                  void *user);
+
+/* Opens the device and negotiates the format and buffers. */
+capture *capture_open(const struct capture_config *config);
+void capture_close(capture * cap);
+
+/*
+ * Renegotiates format, size and I/O method on the open device. Streaming
+ * is stopped, buffers are reallocated and streaming resumes if it was on.
+ * Frames borrowed before must have been released. On failure the device
+ * is left without buffers; another capture_reconfigure() may recover it.
+ */
+int capture_reconfigure(capture * cap, const struct capture_config *config);
+
+/* Returns 1 if the device's capabilities allow the I/O method, else 0. */
+int capture_supports(const capture * cap, capture_io io);
+
+/* The format the driver accepted, may differ from what was asked for. */
+const struct v4l2_pix_format *capture_format(const capture * cap);
+
+/* File descriptor to poll for readability before capture_borrow(). */
+int capture_fd(const capture * cap);
+
+int capture_start(capture * cap);
+int capture_stop(capture * cap);
+
+/* Returns 1 and fills frame, 0 if no frame is ready yet, -1 on error. */
+int capture_borrow(capture * cap, struct capture_frame *frame);
+
+/* Hands a borrowed buffer back to the driver. */
+int capture_release(capture * cap, const struct capture_frame *frame);
+
+/* Starts streaming and delivers frames to callback on a new thread. */
+int capture_start_async(capture * cap, capture_callback callback, void *user);
+
+/* Stops the thread started by capture_start_async() and streaming. */
+int capture_stop_async(capture * cap);
+
+#endif
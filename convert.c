@@ -0,0 +1,199 @@
+/*
+ * YUYV to RGB conversion through the YCbCr lookup table.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "convert.h"
+#include "framestats.h"
+#include "util.h"
+
+#define max(a, b) (a > b ? a : b)
+#define min(a, b) (a > b ? b : a)
+
+void YCbCrToRGB(int y, int cb, int cr, uint8_t * r, uint8_t * g, uint8_t * b)
+{
+    double Y = (double)y;
+    double Cb = (double)cb;
+    double Cr = (double)cr;
+
+    int R = (int)(Y + 1.40200 * (Cr - 0x80));
+    int G = (int)(Y - 0.34414 * (Cb - 0x80) - 0.71414 * (Cr - 0x80));
+    int B = (int)(Y + 1.77200 * (Cb - 0x80));
+
+    *r = max(0, min(255, R));
+    *g = max(0, min(255, G));
+    *b = max(0, min(255, B));
+}
+
+uint32_t YCbCr_to_RGB[256][256][256];
+
+#define LUT_MAX_THREADS 8
+
+static struct
+{
+    pthread_t thread;
+    int started;
+    int y0;
+    int y1;
+    uint64_t done;              /* now_ns() when the slice was filled */
+} lut_slices[LUT_MAX_THREADS];
+
+/*
+ * Fills Y planes y0 to y1 - 1. The expressions are those of YCbCrToRGB(),
+ * with the terms that do not depend on Cr taken out of the inner loop, so
+ * the table matches it bit for bit.
+ */
+static void generate_YCbCr_to_RGB_planes(int y0, int y1)
+{
+    double Cr_g[256];
+    uint32_t R_row[256];
+    int y;
+    int cb;
+    int cr;
+
+    for (cr = 0; cr < 256; cr++)
+        Cr_g[cr] = 0.71414 * ((double)cr - 0x80);
+
+    for (y = y0; y < y1; y++)
+    {
+        double Y = (double)y;
+
+        for (cr = 0; cr < 256; cr++)
+        {
+            int R = (int)(Y+1.40200*((double)cr - 0x80));
+
+            R_row[cr] = max(0, min(255, R)) << 16;
+        }
+
+        for (cb = 0; cb < 256; cb++)
+        {
+            double Cb = (double)cb;
+            double Y_g = Y-0.34414*(Cb - 0x80);
+            int B = (int)(Y+1.77200*(Cb - 0x80));
+
+            B = max(0, min(255, B));
+
+            for (cr = 0; cr < 256; cr++)
+            {
+                int G = (int)(Y_g - Cr_g[cr]);
+
+                G = max(0, min(255, G));
+
+                YCbCr_to_RGB[y][cb][cr] = R_row[cr] | G << 8 | B;
+            }
+        }
+    }
+}
+
+static void *lut_thread(void *arg)
+{
+    int i = (int)(intptr_t)arg;
+
+    generate_YCbCr_to_RGB_planes(lut_slices[i].y0, lut_slices[i].y1);
+    lut_slices[i].done = now_ns();
+
+    return NULL;
+}
+
+void lut_start(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = cpus < 1 ? 1 : cpus > LUT_MAX_THREADS ? LUT_MAX_THREADS : cpus;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        lut_slices[i].y0 = 256 * i / n;
+        lut_slices[i].y1 = 256 * (i + 1) / n;
+        lut_slices[i].started =
+            0 == start_worker(&lut_slices[i].thread, lut_thread,
+                              (void *)(intptr_t)i);
+    }
+
+    /* Unused slices, filled in no time. */
+    for (; i < LUT_MAX_THREADS; i++)
+    {
+        lut_slices[i].y0 = lut_slices[i].y1 = 0;
+        lut_slices[i].done = 0;
+    }
+}
+
+uint64_t lut_wait(void)
+{
+    uint64_t done = 0;
+    int i;
+
+    for (i = 0; i < LUT_MAX_THREADS; i++)
+    {
+        if (lut_slices[i].started)
+            pthread_join(lut_slices[i].thread, NULL);
+        else if (lut_slices[i].y0 < lut_slices[i].y1)
+        {
+            generate_YCbCr_to_RGB_planes(lut_slices[i].y0, lut_slices[i].y1);
+            lut_slices[i].done = now_ns();
+        }
+
+        lut_slices[i].started = 0;
+        done = max(done, lut_slices[i].done);
+    }
+
+    return done;
+}
+
+void generate_YCbCr_to_RGB_lookup(void)
+{
+    lut_start();
+    lut_wait();
+}
+
+#define COLOR_GET_RED(color)   ((color >> 16) & 0xFF)
+#define COLOR_GET_GREEN(color) ((color >> 8) & 0xFF)
+#define COLOR_GET_BLUE(color)  (color & 0xFF)
+
+/**
+ *  Converts YUV422 to RGB
+ *  Before first use call generate_YCbCr_to_RGB_lookup(), or lut_start()
+ *  followed by lut_wait();
+ *
+ *  input is pointer to YUV422 encoded data in following order: Y0, Cb, Y1, Cr.
+ *  output is pointer to 24 bit RGB buffer.
+ *  Output data is written in following order: R1, G1, B1, R2, G2, B2.
+ */
+static inline void YUV422_to_RGB(uint8_t * output, const uint8_t * input)
+{
+    uint8_t y0 = input[0];
+    uint8_t cb = input[1];
+    uint8_t y1 = input[2];
+    uint8_t cr = input[3];
+
+    uint32_t rgb = YCbCr_to_RGB[y0][cb][cr];
+    output[0] = COLOR_GET_RED(rgb);
+    output[1] = COLOR_GET_GREEN(rgb);
+    output[2] = COLOR_GET_BLUE(rgb);
+
+    rgb = YCbCr_to_RGB[y1][cb][cr];
+    output[3] = COLOR_GET_RED(rgb);
+    output[4] = COLOR_GET_GREEN(rgb);
+    output[5] = COLOR_GET_BLUE(rgb);
+
+
+}
+
+void YUV422_row_to_RGB(uint8_t * output, const uint8_t * input, size_t width)
+{
+    size_t x;
+
+    for (x = 0; x < width; x += 2)
+        YUV422_to_RGB(output + x * 3, input + x * 2);
+}
+
+void YUV422_row_to_RGB_stats(uint8_t * output, const uint8_t * input,
+                             size_t width)
+{
+    YUV422_row_to_RGB(output, input, width);
+    framestats_row(output, input, width);
+}
@@ -0,0 +1,55 @@
+/*
+ * YUYV to 24 bit RGB conversion.
+ *
+ * Pixels are looked up in a table indexed by Y, Cb and Cr that holds the
+ * result of YCbCrToRGB() for every input, so the per pixel cost is two
+ * loads. The table is 64 MB and takes a while to fill; lut_start() fills
+ * it in the background and lut_wait() blocks until it is done.
+ */
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Indexes are [Y][Cb][Cr], range 0-255.
+ *
+ * Stored value bits:
+ *   24-16 Red
+ *   15-8  Green
+ *   7-0   Blue
+ */
+extern uint32_t YCbCr_to_RGB[256][256][256];
+
+/* The conversion the table holds, JFIF full range, truncated and clamped. */
+void YCbCrToRGB(int y, int cb, int cr, uint8_t * r, uint8_t * g, uint8_t * b);
+
+/*
+ * Starts filling the lookup table, split over the online CPUs. Slices
+ * whose thread cannot be created are filled by lut_wait().
+ */
+void lut_start(void);
+
+/*
+ * Blocks until the table started by lut_start() is complete. Returns the
+ * now_ns() time the last slice was finished at, which may be well before
+ * the call.
+ */
+uint64_t lut_wait(void);
+
+/* lut_start() followed by lut_wait(). */
+void generate_YCbCr_to_RGB_lookup(void);
+
+/*
+ * Converts width YUYV pixels, in the order Y0, Cb, Y1, Cr, to R, G, B
+ * triplets. The table must be complete.
+ */
+void YUV422_row_to_RGB(uint8_t * output, const uint8_t * input, size_t width);
+
+/* Same as YUV422_row_to_RGB(), also feeding the row to the frame statistics. */
+void YUV422_row_to_RGB_stats(uint8_t * output, const uint8_t * input,
+                             size_t width);
+
+#endif
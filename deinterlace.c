@@ -0,0 +1,217 @@
+/*
+ * Deinterlacing of V4L2_FIELD_ALTERNATE sources.
+ *
+ * The top field holds frame lines 0, 2, 4, ..., the bottom field lines
+ * 1, 3, 5, .... Every field produces one output frame, so 50/60 fields per
+ * second sources are displayed at 50/60 frames per second.
+ *
+ * Line kernels work on YUYV bytes without telling luma from chroma; both
+ * are interpolated the same way. SSE2 versions process 16 bytes at a time
+ * and round like the scalar tails, (a + b + 1) / 2.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "deinterlace.h"
+
+static const char *mode_names[DEINTERLACE_COUNT] = {
+    "weave", "bob", "adaptive"
+};
+
+static size_t width;
+static size_t field_lines;
+static size_t line_bytes;
+
+static uint8_t *prev_field = NULL;
+static int have_prev = 0;
+static int prev_bottom = 0;
+static uint8_t *line = NULL;
+
+int deinterlace_parse_mode(const char *name, deinterlace_mode * mode)
+{
+    int m;
+
+    for (m = 0; m < DEINTERLACE_COUNT; m++)
+    {
+        if (!strcmp(name, mode_names[m]))
+        {
+            *mode = m;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+const char *deinterlace_mode_name(deinterlace_mode mode)
+{
+    return mode_names[mode];
+}
+
+int deinterlace_init(size_t w, size_t lines)
+{
+    width = w;
+    field_lines = lines;
+    line_bytes = w * 2;
+
+    prev_field = malloc(line_bytes * field_lines);
+    line = malloc(line_bytes);
+
+    if (!prev_field || !line)
+    {
+        deinterlace_free();
+        return -1;
+    }
+
+    have_prev = 0;
+
+    return 0;
+}
+
+void deinterlace_free(void)
+{
+    free(prev_field);
+    free(line);
+
+    prev_field = NULL;
+    line = NULL;
+    have_prev = 0;
+}
+
+void deinterlace_bob_line(uint8_t * out, const uint8_t * above,
+                          const uint8_t * below, size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(above + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(below + i));
+
+        _mm_storeu_si128((__m128i *)(out + i), _mm_avg_epu8(a, b));
+    }
+#endif
+
+    for (; i < n; i++)
+        out[i] = (above[i] + below[i] + 1) >> 1;
+}
+
+void deinterlace_adaptive_line(uint8_t * out, const uint8_t * above,
+                               const uint8_t * below, const uint8_t * prev,
+                               size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i threshold = _mm_set1_epi8(DEINTERLACE_MOTION_THRESHOLD);
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(above + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(below + i));
+        __m128i w = _mm_loadu_si128((const __m128i *)(prev + i));
+        __m128i s = _mm_avg_epu8(a, b);
+        __m128i d = _mm_or_si128(_mm_subs_epu8(w, s), _mm_subs_epu8(s, w));
+
+        /* still = d <= threshold, unsigned compare via min */
+        __m128i still = _mm_cmpeq_epi8(_mm_min_epu8(d, threshold), d);
+
+        _mm_storeu_si128((__m128i *)(out + i),
+                         _mm_or_si128(_mm_and_si128(still, w),
+                                      _mm_andnot_si128(still, s)));
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        int s = (above[i] + below[i] + 1) >> 1;
+        int d = prev[i] > s ? prev[i] - s : s - prev[i];
+
+        out[i] = d <= DEINTERLACE_MOTION_THRESHOLD ? prev[i] : s;
+    }
+}
+
+void deinterlace_field(uint8_t * rgb, const uint8_t * field, size_t stride,
+                       int bottom, deinterlace_mode mode,
+                       deinterlace_row_fn convert)
+{
+    size_t y;
+
+    /*
+     * Nothing to weave with yet, or the previous field has the same
+     * parity because one was dropped: its lines are not the missing ones.
+     */
+    if (!have_prev || prev_bottom == bottom)
+        mode = DEINTERLACE_BOB;
+
+    for (y = 0; y < 2 * field_lines; y++)
+    {
+        const uint8_t *src;
+        size_t k = y / 2;
+
+        if ((y & 1) == (size_t)bottom)
+        {
+            /* Line present in this field. */
+            src = field + k * stride;
+        }
+        else
+        {
+            /*
+             * Missing line, between field lines above and below. The
+             * previous field, of the other parity, has it at index k;
+             * nothing else reads that entry, so once the line is
+             * converted field line k, still in cache, replaces it.
+             */
+            size_t ia = bottom ? (k ? k - 1 : 0) : k;
+            size_t ib = bottom ? k : k + 1;
+            const uint8_t *above;
+            const uint8_t *below;
+            const uint8_t *prev;
+
+            if (ia >= field_lines)
+                ia = field_lines - 1;
+            if (ib >= field_lines)
+                ib = field_lines - 1;
+            if (k >= field_lines)
+                k = field_lines - 1;
+
+            above = field + ia * stride;
+            below = field + ib * stride;
+            prev = prev_field + k * line_bytes;
+
+            switch (mode)
+            {
+            case DEINTERLACE_WEAVE:
+                src = prev;
+                break;
+
+            case DEINTERLACE_ADAPTIVE:
+                deinterlace_adaptive_line(line, above, below, prev, line_bytes);
+                src = line;
+                break;
+
+            case DEINTERLACE_BOB:
+            default:
+                deinterlace_bob_line(line, above, below, line_bytes);
+                src = line;
+                break;
+            }
+        }
+
+        convert(rgb + y * width * 3, src, width);
+
+        if ((y & 1) != (size_t)bottom)
+            memcpy(prev_field + k * line_bytes, field + k * stride, line_bytes);
+    }
+
+    have_prev = 1;
+    prev_bottom = bottom;
+}
@@ -0,0 +1,60 @@
+/*
+ * Deinterlacing of V4L2_FIELD_ALTERNATE sources.
+ *
+ * Each field is turned into a full height frame line by line: a missing
+ * line is built in a small buffer that stays in L1 and is handed to the
+ * color converter right away, and the field line it came from is copied
+ * into the history while still cached, so the field is read from memory
+ * once and the output and history written once.
+ */
+
+#ifndef DEINTERLACE_H
+#define DEINTERLACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    DEINTERLACE_WEAVE,          /* interleave with the previous field */
+    DEINTERLACE_BOB,            /* interpolate missing lines from this field */
+    DEINTERLACE_ADAPTIVE,       /* weave where still, bob where moving */
+    DEINTERLACE_COUNT
+} deinterlace_mode;
+
+/* Byte difference to the interpolated value up to which a pixel counts as still. */
+#define DEINTERLACE_MOTION_THRESHOLD 12
+
+/* Converts one line of width YUYV pixels to 24 bit RGB. */
+typedef void (*deinterlace_row_fn) (uint8_t * rgb, const uint8_t * yuyv,
+                                    size_t width);
+
+/* Parses "weave", "bob", "adaptive". Returns -1 if unknown. */
+int deinterlace_parse_mode(const char *name, deinterlace_mode * mode);
+const char *deinterlace_mode_name(deinterlace_mode mode);
+
+/*
+ * Allocates field history for fields of width x lines, as pix.height
+ * reports them. Returns 0 on success.
+ */
+int deinterlace_init(size_t width, size_t lines);
+void deinterlace_free(void);
+
+/*
+ * Converts one field of lines YUYV lines, stride bytes apart, into a
+ * 2 * lines RGB frame and remembers it as the previous field. Weave and
+ * adaptive fall back to bob unless the previous field had the other
+ * parity.
+ */
+void deinterlace_field(uint8_t * rgb, const uint8_t * field, size_t stride,
+                       int bottom, deinterlace_mode mode,
+                       deinterlace_row_fn convert);
+
+/* Line kernels, n is in bytes. */
+void deinterlace_bob_line(uint8_t * out, const uint8_t * above,
+                          const uint8_t * below, size_t n);
+void deinterlace_adaptive_line(uint8_t * out, const uint8_t * above,
+                               const uint8_t * below, const uint8_t * prev,
+                               size_t n);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * Temporal noise reduction of YUYV frames.
+ *
+ * The filter is h' = (3h + c + 2) / 4, rounded to nearest, worked out in
+ * 16-bit lanes in SSE2. Luma and chroma bytes are treated alike and the
+ * motion test is per byte.
+ *
+ * The calling thread filters the first band itself and wakes one worker
+ * per remaining band, so a frame costs one wakeup per worker and the
+ * history is written in place without extra copies.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "denoise.h"
+#include "util.h"
+
+#define DENOISE_MAX_THREADS 8
+
+static size_t line_bytes;
+static size_t n_lines;
+static unsigned int motion_threshold;
+
+static uint8_t *history[2] = { NULL, NULL };
+static int have_history[2];
+
+static pthread_t threads[DENOISE_MAX_THREADS];
+static unsigned int n_bands = 1;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static unsigned long generation = 0;
+static unsigned int pending = 0;
+static int stopping = 0;
+
+/* The frame being filtered, set before workers are woken. */
+static uint8_t *job_history;
+static const uint8_t *job_frame;
+static size_t job_stride;
+
+void denoise_line(uint8_t * h, const uint8_t * cur, size_t n,
+                  unsigned int threshold)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i limit = _mm_set1_epi8((char)(threshold > 255 ? 255 : threshold));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i *)(cur + i));
+        __m128i p = _mm_loadu_si128((const __m128i *)(h + i));
+        __m128i pl = _mm_unpacklo_epi8(p, zero);
+        __m128i ph = _mm_unpackhi_epi8(p, zero);
+        __m128i fl = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(pl, 1), pl),
+                                   _mm_add_epi16(_mm_unpacklo_epi8(c, zero), two));
+        __m128i fh = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(ph, 1), ph),
+                                   _mm_add_epi16(_mm_unpackhi_epi8(c, zero), two));
+        __m128i f = _mm_packus_epi16(_mm_srli_epi16(fl, 2), _mm_srli_epi16(fh, 2));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(c, p), _mm_subs_epu8(p, c));
+
+        /* still = d <= threshold, unsigned compare via min */
+        __m128i still = _mm_cmpeq_epi8(_mm_min_epu8(d, limit), d);
+
+        _mm_storeu_si128((__m128i *)(h + i),
+                         _mm_or_si128(_mm_and_si128(still, f),
+                                      _mm_andnot_si128(still, c)));
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        int d = cur[i] > h[i] ? cur[i] - h[i] : h[i] - cur[i];
+
+        if ((unsigned int)d <= threshold)
+            h[i] = (3 * h[i] + cur[i] + 2) >> 2;
+        else
+            h[i] = cur[i];
+    }
+}
+
+static void denoise_band(unsigned int band)
+{
+    size_t first = n_lines * band / n_bands;
+    size_t last = n_lines * (band + 1) / n_bands;
+    size_t y;
+
+    /* Packed frames are filtered as one long line. */
+    if (job_stride == line_bytes)
+    {
+        denoise_line(job_history + first * line_bytes, job_frame + first * line_bytes,
+                     (last - first) * line_bytes, motion_threshold);
+        return;
+    }
+
+    for (y = first; y < last; y++)
+        denoise_line(job_history + y * line_bytes, job_frame + y * job_stride,
+                     line_bytes, motion_threshold);
+}
+
+static void *denoise_thread(void *arg)
+{
+    unsigned int band = (unsigned int)(uintptr_t)arg;
+    unsigned long seen = 0;
+
+    for (;;)
+    {
+        int stop;
+
+        pthread_mutex_lock(&lock);
+        while (generation == seen && !stopping)
+            pthread_cond_wait(&start, &lock);
+        seen = generation;
+        stop = stopping;
+        pthread_mutex_unlock(&lock);
+
+        if (stop)
+            break;
+
+        denoise_band(band);
+
+        pthread_mutex_lock(&lock);
+        if (0 == --pending)
+            pthread_cond_signal(&done);
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+int denoise_init(size_t width, size_t lines, int fields, unsigned int threshold)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int wanted = cpus < 1 ? 1 : cpus > DENOISE_MAX_THREADS ?
+                          DENOISE_MAX_THREADS : cpus;
+    int f;
+
+    line_bytes = width * 2;
+    n_lines = lines;
+    motion_threshold = threshold;
+
+    for (f = 0; f < 2; f++)
+    {
+        have_history[f] = 0;
+
+        if (f < fields && !(history[f] = malloc(line_bytes * n_lines)))
+        {
+            denoise_free();
+            return -1;
+        }
+    }
+
+    /* No workers are alive here, they start counting from 0. */
+    stopping = 0;
+    generation = 0;
+    for (n_bands = 1; n_bands < wanted; n_bands++)
+        if (start_worker(&threads[n_bands], denoise_thread,
+                         (void *)(uintptr_t)n_bands))
+            break;
+
+    return 0;
+}
+
+const uint8_t *denoise_frame(const uint8_t * yuyv, size_t stride, int field)
+{
+    uint8_t *h = history[field] ? history[field] : history[0];
+    size_t y;
+
+    if (!have_history[field])
+    {
+        for (y = 0; y < n_lines; y++)
+            memcpy(h + y * line_bytes, yuyv + y * stride, line_bytes);
+        have_history[field] = 1;
+        return h;
+    }
+
+    job_history = h;
+    job_frame = yuyv;
+    job_stride = stride;
+
+    if (n_bands > 1)
+    {
+        pthread_mutex_lock(&lock);
+        pending = n_bands - 1;
+        generation++;
+        pthread_cond_broadcast(&start);
+        pthread_mutex_unlock(&lock);
+    }
+
+    denoise_band(0);
+
+    if (n_bands > 1)
+    {
+        pthread_mutex_lock(&lock);
+        while (pending)
+            pthread_cond_wait(&done, &lock);
+        pthread_mutex_unlock(&lock);
+    }
+
+    return h;
+}
+
+void denoise_free(void)
+{
+    unsigned int i;
+    int f;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&start);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 1; i < n_bands; i++)
+        pthread_join(threads[i], NULL);
+
+    n_bands = 1;
+
+    for (f = 0; f < 2; f++)
+    {
+        free(history[f]);
+        history[f] = NULL;
+        have_history[f] = 0;
+    }
+}
@@ -0,0 +1,40 @@
+/*
+ * Temporal noise reduction of YUYV frames.
+ *
+ * Each output byte moves a quarter of the way from the history towards
+ * the new frame, unless the two differ by more than the motion threshold,
+ * in which case the new value is taken as it is so moving objects do not
+ * smear. The result becomes the history for the next frame. Frames are
+ * split into bands of lines filtered on worker threads in parallel.
+ */
+
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Difference in levels above which a byte counts as moving. */
+#define DENOISE_DEFAULT_THRESHOLD 10
+
+/*
+ * Prepares for frames of width x lines YUYV pixels. fields is 2 for
+ * V4L2_FIELD_ALTERNATE sources, which keep a history per field parity,
+ * 1 otherwise. Returns -1 if out of memory.
+ */
+int denoise_init(size_t width, size_t lines, int fields, unsigned int threshold);
+
+/*
+ * Filters a frame with lines stride bytes apart and returns the result,
+ * packed at width * 2 bytes per line and valid until the next call.
+ * field selects the history, 0 or 1 for the bottom field.
+ */
+const uint8_t *denoise_frame(const uint8_t * yuyv, size_t stride, int field);
+
+/* Filters n bytes of one line, exported for the self test. */
+void denoise_line(uint8_t * history, const uint8_t * cur, size_t n,
+                  unsigned int threshold);
+
+void denoise_free(void);
+
+#endif
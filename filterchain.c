@@ -0,0 +1,231 @@
+/*
+ * Per frame processing chain.
+ *
+ * Each stage keeps a running estimate of what its full and its degraded
+ * variant cost. Before a stage that can be cut runs, the chain checks
+ * whether the time already spent, the estimate for the stage and the
+ * estimates of the mandatory stages still to come fit in the budget.
+ * It falls back to the degraded variant and then to skipping until they
+ * do. Mandatory stages always run, degraded only if nothing else fits.
+ *
+ * A cut stage is not measured, so its estimate would stay at whatever
+ * made it too expensive. Every FILTER_PROBE_INTERVAL cut frames it runs
+ * in full once and its estimate is reset to what that run took.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "filterchain.h"
+#include "util.h"
+
+#define FILTER_MAX_STAGES 16
+#define FILTER_PROBE_INTERVAL 64
+
+struct stage_state
+{
+    struct filter_stage stage;
+
+    /* Running averages, 0 until first measured. */
+    uint64_t cost;
+    uint64_t degraded_cost;
+
+    unsigned int cut_streak;
+
+    unsigned long runs;
+    unsigned long degraded;
+    unsigned long skipped;
+    uint64_t total_ns;
+};
+
+static struct stage_state stages[FILTER_MAX_STAGES];
+static int n_stages = 0;
+
+static uint64_t budget = 0;
+static unsigned long frames = 0;
+static unsigned long late = 0;
+
+/* Exponential moving average with a weight of 1/8 for the new sample. */
+static void update_cost(uint64_t * cost, uint64_t sample)
+{
+    *cost = *cost ? *cost - *cost / 8 + sample / 8 : sample;
+}
+
+int filterchain_add(const struct filter_stage *stage)
+{
+    if (n_stages == FILTER_MAX_STAGES)
+    {
+        fprintf(stderr, "Too many filter stages, %s not added\n", stage->name);
+        return -1;
+    }
+
+    if (n_stages && stages[n_stages - 1].stage.output != stage->input)
+    {
+        fprintf(stderr, "Filter %s does not take the output of %s\n",
+                stage->name, stages[n_stages - 1].stage.name);
+        return -1;
+    }
+
+    if ((stage->in_place || stage->optional) && stage->input != stage->output)
+    {
+        fprintf(stderr, "Filter %s must keep the pixel format\n", stage->name);
+        return -1;
+    }
+
+    if (stage->optional && !stage->in_place)
+    {
+        fprintf(stderr, "Optional filter %s must work in place\n", stage->name);
+        return -1;
+    }
+
+    memset(&stages[n_stages], 0, sizeof(stages[n_stages]));
+    stages[n_stages].stage = *stage;
+    n_stages++;
+
+    return 0;
+}
+
+void filterchain_clear(void)
+{
+    n_stages = 0;
+    frames = 0;
+    late = 0;
+}
+
+void filterchain_set_budget(uint64_t ns)
+{
+    budget = ns;
+}
+
+/* Estimated cost of the mandatory stages after stage i. */
+static uint64_t reserved_after(int i)
+{
+    uint64_t t = 0;
+
+    for (i++; i < n_stages; i++)
+        if (!stages[i].stage.optional)
+            t += stages[i].cost;
+
+    return t;
+}
+
+/* Picks the variant of stage i to run, NULL to skip it. */
+static filter_fn schedule(struct stage_state *st, int i, uint64_t elapsed)
+{
+    uint64_t left;
+
+    if (!budget || (!st->stage.optional && !st->stage.degraded))
+        return st->stage.run;
+
+    if (st->cut_streak >= FILTER_PROBE_INTERVAL)
+        return st->stage.run;
+
+    left = budget > elapsed ? budget - elapsed : 0;
+    left = left > reserved_after(i) ? left - reserved_after(i) : 0;
+
+    if (st->cost <= left)
+        return st->stage.run;
+
+    if (st->stage.degraded && st->degraded_cost <= left)
+        return st->stage.degraded;
+
+    if (st->stage.optional)
+        return NULL;
+
+    return st->stage.degraded;
+}
+
+int filterchain_run(const struct filter_frame *frame)
+{
+    struct filter_frame in = *frame;
+    struct filter_frame out;
+    uint64_t start = now_ns();
+    uint64_t t = start;
+    int i;
+
+    for (i = 0; i < n_stages; i++)
+    {
+        struct stage_state *st = &stages[i];
+        filter_fn fn = schedule(st, i, t - start);
+        uint64_t end;
+
+        if (!fn)
+        {
+            st->skipped++;
+            st->cut_streak++;
+            continue;
+        }
+
+        out = in;
+        if (!st->stage.in_place)
+            out.data = NULL;
+        out.format = st->stage.output;
+
+        if (-1 == fn(&in, &out))
+            return -1;
+
+        if (!out.data)
+        {
+            fprintf(stderr, "Filter %s produced no frame\n", st->stage.name);
+            return -1;
+        }
+
+        end = now_ns();
+
+        if (fn == st->stage.run)
+        {
+            /* A probe replaces the stale estimate instead of averaging with it. */
+            if (st->cut_streak >= FILTER_PROBE_INTERVAL)
+                st->cost = end - t;
+            else
+                update_cost(&st->cost, end - t);
+            st->cut_streak = 0;
+        }
+        else
+        {
+            update_cost(&st->degraded_cost, end - t);
+            st->degraded++;
+            st->cut_streak++;
+        }
+
+        st->runs++;
+        st->total_ns += end - t;
+
+        in = out;
+        t = end;
+    }
+
+    frames++;
+    if (budget && t - start > budget)
+        late++;
+
+    return 0;
+}
+
+void filterchain_report(FILE * fp)
+{
+    int i;
+
+    if (!frames)
+        return;
+
+    fprintf(fp, "%-12s %10s %10s %10s %10s\n",
+            "stage", "runs", "degraded", "skipped", "mean us");
+
+    for (i = 0; i < n_stages; i++)
+    {
+        const struct stage_state *st = &stages[i];
+
+        fprintf(fp, "%-12s %10lu %10lu %10lu %10.1f\n", st->stage.name,
+                st->runs, st->degraded, st->skipped,
+                st->runs ? st->total_ns / 1e3 / st->runs : 0.0);
+    }
+
+    if (budget)
+        fprintf(fp, "%lu of %lu frames over the %.1f ms budget\n",
+                late, frames, budget / 1e6);
+}
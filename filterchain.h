@@ -0,0 +1,75 @@
+/*
+ * Per frame processing chain.
+ *
+ * Stages are registered in the order they run, each declaring the pixel
+ * format it takes and the one it produces. Every stage is timed, and
+ * with a budget set the chain drops optional stages or falls back to
+ * their cheaper variants when running them in full would make the frame
+ * late.
+ */
+
+#ifndef FILTERCHAIN_H
+#define FILTERCHAIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <linux/videodev2.h>
+
+typedef enum
+{
+    FILTER_YUYV,
+    FILTER_RGB24,
+} filter_format;
+
+struct filter_frame
+{
+    uint8_t *data;
+    size_t width;
+    size_t height;
+    size_t stride;              /* bytes per line */
+    filter_format format;
+    enum v4l2_field field;
+};
+
+/*
+ * Runs a stage on in and describes the result in out. For in place
+ * stages out starts as a copy of in and may be narrowed to a part of it,
+ * other stages must point out->data at their own buffer.
+ * Returning -1 stops the chain for this frame.
+ */
+typedef int (*filter_fn) (const struct filter_frame * in,
+                          struct filter_frame * out);
+
+struct filter_stage
+{
+    const char *name;
+    filter_format input;
+    filter_format output;
+    int in_place;
+    int optional;               /* may be skipped to keep the budget */
+    filter_fn run;
+    filter_fn degraded;         /* cheaper variant or NULL */
+};
+
+/*
+ * Appends a stage. Returns -1 if the chain is full or the stage does not
+ * take what the previous one produces. Optional stages must be in place
+ * so skipping them leaves the frame usable.
+ */
+int filterchain_add(const struct filter_stage *stage);
+
+/* Removes all stages and their timings. */
+void filterchain_clear(void);
+
+/* Time a frame may spend in the chain, 0 runs every stage in full. */
+void filterchain_set_budget(uint64_t ns);
+
+/* Runs the chain on frame, returns -1 if a stage failed. */
+int filterchain_run(const struct filter_frame *frame);
+
+/* Prints per stage timings and how often the budget cut stages. */
+void filterchain_report(FILE * fp);
+
+#endif
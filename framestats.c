@@ -0,0 +1,227 @@
+/*
+ * Per frame image statistics for camera health monitoring.
+ *
+ * The focus score is the variance of the 4-neighbour Laplacian of luma
+ * over the interior of the frame. Luma of the last three rows is kept in
+ * a small ring so the Laplacian of a row can be taken once the row below
+ * it has arrived, whatever buffer the rows came from.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "framestats.h"
+
+#define HISTOGRAM_W 256
+#define HISTOGRAM_H 64
+
+static uint8_t *luma_rows = NULL;
+static size_t luma_width = 0;
+static size_t row = 0;
+
+/* min, max and mean are derived from these once per frame. */
+static uint32_t histogram[FRAMESTATS_CHANNELS][256];
+static int64_t lap_sum;
+static uint64_t lap_sq_sum;
+static uint32_t lap_n;
+static uint32_t pixels;
+
+int framestats_begin(size_t width)
+{
+    if (width != luma_width)
+    {
+        free(luma_rows);
+
+        luma_rows = malloc(width * 3);
+        luma_width = luma_rows ? width : 0;
+
+        if (!luma_rows)
+            return -1;
+    }
+
+    memset(histogram, 0, sizeof(histogram));
+
+    lap_sum = 0;
+    lap_sq_sum = 0;
+    lap_n = 0;
+    pixels = 0;
+    row = 0;
+
+    return 0;
+}
+
+static void laplacian_row(const uint8_t * up, const uint8_t * mid,
+                          const uint8_t * down, size_t width)
+{
+    int64_t sum = 0;
+    uint64_t sq = 0;
+    size_t x = 1;
+
+#ifdef __SSE2__
+    /*
+     * 8 pixels per step in 16 bit lanes. The 32 bit lane sums of squares
+     * cannot overflow for rows up to 8192 pixels.
+     */
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i vsum = zero;
+    __m128i vsq = zero;
+    int32_t lanes[4];
+
+    for (; x + 9 <= width; x += 8)
+    {
+        __m128i u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(up + x)), zero);
+        __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(down + x)), zero);
+        __m128i m = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mid + x)), zero);
+        __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mid + x - 1)), zero);
+        __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(mid + x + 1)), zero);
+        __m128i lap = _mm_sub_epi16(_mm_slli_epi16(m, 2),
+                                    _mm_add_epi16(_mm_add_epi16(u, d),
+                                                  _mm_add_epi16(l, r)));
+
+        vsum = _mm_add_epi32(vsum, _mm_madd_epi16(lap, ones));
+        vsq = _mm_add_epi32(vsq, _mm_madd_epi16(lap, lap));
+    }
+
+    _mm_storeu_si128((__m128i *)lanes, vsum);
+    sum += (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_si128((__m128i *)lanes, vsq);
+    sq += (uint64_t)(uint32_t)lanes[0] + (uint32_t)lanes[1] +
+          (uint32_t)lanes[2] + (uint32_t)lanes[3];
+#endif
+
+    for (; x + 1 < width; x++)
+    {
+        int l = 4 * mid[x] - up[x] - down[x] - mid[x - 1] - mid[x + 1];
+
+        sum += l;
+        sq += (uint64_t)(l * l);
+    }
+
+    lap_sum += sum;
+    lap_sq_sum += sq;
+    lap_n += width - 2;
+}
+
+void framestats_row(const uint8_t * rgb, const uint8_t * yuyv, size_t width)
+{
+    uint8_t *luma = luma_rows + (row % 3) * width;
+    size_t x;
+
+    for (x = 0; x < width; x++)
+    {
+        uint8_t y = yuyv[x * 2];
+        uint8_t r = rgb[x * 3];
+        uint8_t g = rgb[x * 3 + 1];
+        uint8_t b = rgb[x * 3 + 2];
+
+        luma[x] = y;
+
+        histogram[FRAMESTATS_Y][y]++;
+        histogram[FRAMESTATS_R][r]++;
+        histogram[FRAMESTATS_G][g]++;
+        histogram[FRAMESTATS_B][b]++;
+
+    }
+
+    pixels += width;
+
+    if (row >= 2 && width >= 3)
+        laplacian_row(luma_rows + ((row - 2) % 3) * width,
+                      luma_rows + ((row - 1) % 3) * width, luma, width);
+
+    row++;
+}
+
+void framestats_end(struct frame_stats *stats)
+{
+    int c;
+    int i;
+
+    memcpy(stats->histogram, histogram[FRAMESTATS_Y], sizeof(stats->histogram));
+
+    for (c = 0; c < FRAMESTATS_CHANNELS; c++)
+    {
+        uint64_t sum = 0;
+
+        stats->min[c] = 255;
+        stats->max[c] = 0;
+
+        for (i = 0; i < 256; i++)
+        {
+            if (!histogram[c][i])
+                continue;
+
+            if (i < stats->min[c])
+                stats->min[c] = i;
+            stats->max[c] = i;
+            sum += (uint64_t)i * histogram[c][i];
+        }
+
+        stats->mean[c] = pixels ? (double)sum / pixels : 0.0;
+        stats->clipped_low[c] = histogram[c][0];
+        stats->clipped_high[c] = histogram[c][255];
+    }
+
+    if (lap_n)
+    {
+        double mean = (double)lap_sum / lap_n;
+
+        stats->focus = (double)lap_sq_sum / lap_n - mean * mean;
+    }
+    else
+    {
+        stats->focus = 0.0;
+    }
+
+    stats->pixels = pixels;
+}
+
+void framestats_draw(uint8_t * rgb, size_t width, size_t height, size_t stride,
+                     const struct frame_stats *stats)
+{
+    uint32_t peak = 1;
+    size_t x;
+    size_t y;
+    int i;
+
+    if (width < HISTOGRAM_W || height < HISTOGRAM_H)
+        return;
+
+    for (i = 0; i < 256; i++)
+        if (stats->histogram[i] > peak)
+            peak = stats->histogram[i];
+
+    for (x = 0; x < HISTOGRAM_W; x++)
+    {
+        size_t bar = (size_t)stats->histogram[x] * HISTOGRAM_H / peak;
+
+        for (y = 0; y < HISTOGRAM_H; y++)
+        {
+            uint8_t *p = rgb + (height - 1 - y) * stride + x * 3;
+
+            /* Bars in white, background darkened so the bars read on any scene. */
+            if (y < bar)
+                p[0] = p[1] = p[2] = 255;
+            else
+            {
+                p[0] >>= 2;
+                p[1] >>= 2;
+                p[2] >>= 2;
+            }
+        }
+    }
+}
+
+void framestats_free(void)
+{
+    free(luma_rows);
+
+    luma_rows = NULL;
+    luma_width = 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Per frame image statistics for camera health monitoring.
+ *
+ * Accumulated row by row from inside the color conversion loop while the
+ * YUYV input and RGB output of the row are still in L1, so frames are not
+ * read a second time.
+ */
+
+#ifndef FRAMESTATS_H
+#define FRAMESTATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    FRAMESTATS_Y,
+    FRAMESTATS_R,
+    FRAMESTATS_G,
+    FRAMESTATS_B,
+    FRAMESTATS_CHANNELS
+};
+
+struct frame_stats
+{
+    uint32_t histogram[256];    /* luma */
+    uint8_t min[FRAMESTATS_CHANNELS];
+    uint8_t max[FRAMESTATS_CHANNELS];
+    double mean[FRAMESTATS_CHANNELS];
+    double focus;               /* variance of the luma Laplacian */
+    uint32_t clipped_low[FRAMESTATS_CHANNELS];  /* pixels at 0 */
+    uint32_t clipped_high[FRAMESTATS_CHANNELS]; /* pixels at 255 */
+    uint32_t pixels;
+};
+
+/* Starts a frame of the given width. Returns -1 if out of memory. */
+int framestats_begin(size_t width);
+
+/* Accumulates one converted row, rows must come top to bottom. */
+void framestats_row(const uint8_t * rgb, const uint8_t * yuyv, size_t width);
+
+void framestats_end(struct frame_stats *stats);
+
+/* Draws the luma histogram into the bottom left corner of an RGB frame. */
+void framestats_draw(uint8_t * rgb, size_t width, size_t height, size_t stride,
+                     const struct frame_stats *stats);
+
+void framestats_free(void);
+
+#endif
@@ -3,4 +3,5 @@
 sudo apt-get --yes install libsdl2-2.0
 sudo apt-get --yes install libsdl1.2-dev
 sudo apt-get --yes install  v4l-utils
+sudo apt-get --yes install libpng-dev libjpeg-dev zlib1g-dev
 
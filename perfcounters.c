@@ -0,0 +1,320 @@
+/*
+ * Hardware performance counter profiling of the capture pipeline.
+ *
+ * All counters are opened as one group so they are scheduled onto the
+ * PMU together and a single read() returns a consistent snapshot. If the
+ * kernel has to multiplex the group, each stage's deltas are scaled by
+ * the ratio of enabled to running time over that stage, not the
+ * cumulative ratio of each read, so the end never reads below the begin.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <linux/perf_event.h>
+
+#include "perfcounters.h"
+#include "util.h"
+
+#define CLEAR(x) memset (&(x), 0, sizeof (x))
+
+enum
+{
+    EV_CYCLES,
+    EV_INSTRUCTIONS,
+    EV_LLC_MISSES,
+    EV_DTLB_MISSES,
+    EV_COUNT
+};
+
+static const char *stage_names[PERF_STAGE_COUNT] = {
+    "dequeue", "convert", "track", "render"
+};
+
+/* What we hand to the kernel, in group read order. */
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+} event_attrs[EV_COUNT] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+                         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+/* One group read: raw counts and the times they were gathered over. */
+struct group_reading
+{
+    uint64_t enabled;
+    uint64_t running;
+    uint64_t ev[EV_COUNT];
+};
+
+struct stage_counters
+{
+    uint64_t ns;
+    uint64_t ev[EV_COUNT];
+    unsigned long runs;
+};
+
+int perf_enabled = 0;
+
+static int event_fd[EV_COUNT] = { -1, -1, -1, -1 };
+
+/* Position of each event in the group read buffer, -1 if unavailable. */
+static int event_slot[EV_COUNT] = { -1, -1, -1, -1 };
+static int n_slots = 0;
+static int leader_fd = -1;
+
+static struct group_reading begin_reading[PERF_STAGE_COUNT];
+static uint64_t begin_ns[PERF_STAGE_COUNT];
+
+static struct stage_counters frame[PERF_STAGE_COUNT];
+static struct stage_counters total[PERF_STAGE_COUNT];
+static unsigned long n_frames = 0;
+
+static long perf_event_open(struct perf_event_attr *attr, pid_t pid,
+                            int cpu, int group_fd, unsigned long flags)
+{
+    return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static int open_event(int ev, int group_fd, int exclude_kernel)
+{
+    struct perf_event_attr attr;
+
+    CLEAR(attr);
+
+    attr.size = sizeof(attr);
+    attr.type = event_attrs[ev].type;
+    attr.config = event_attrs[ev].config;
+    attr.disabled = (group_fd == -1);
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP |
+                       PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return perf_event_open(&attr, 0, -1, group_fd, 0);
+}
+
+/*
+ * Reads the whole group into out, unscaled. Events that could not be
+ * opened read as zero.
+ */
+static void read_group(struct group_reading *out)
+{
+    uint64_t data[3 + EV_COUNT];
+    int ev;
+
+    CLEAR(*out);
+
+    if (read(leader_fd, data, sizeof(data)) < (ssize_t)((3 + n_slots) * sizeof(uint64_t)))
+        return;
+
+    out->enabled = data[1];
+    out->running = data[2];
+
+    for (ev = 0; ev < EV_COUNT; ev++)
+        if (event_slot[ev] >= 0)
+            out->ev[ev] = data[3 + event_slot[ev]];
+}
+
+int perf_open(void)
+{
+    int exclude_kernel;
+    int ev;
+
+    /*
+     * Dequeue time is spent mostly inside the driver, so count kernel
+     * mode when perf_event_paranoid lets us, user mode only otherwise.
+     */
+    for (exclude_kernel = 0; exclude_kernel < 2; exclude_kernel++)
+    {
+        leader_fd = open_event(EV_CYCLES, -1, exclude_kernel);
+        if (leader_fd != -1)
+            break;
+    }
+
+    if (leader_fd == -1)
+    {
+        fprintf(stderr, "perf_event_open: %d, %s\n", errno, strerror(errno));
+        return -1;
+    }
+
+    event_fd[EV_CYCLES] = leader_fd;
+    event_slot[EV_CYCLES] = n_slots++;
+
+    for (ev = EV_CYCLES + 1; ev < EV_COUNT; ev++)
+    {
+        event_fd[ev] = open_event(ev, leader_fd, exclude_kernel);
+
+        if (event_fd[ev] == -1)
+            continue;           /* Not supported here, reported as n/a. */
+
+        event_slot[ev] = n_slots++;
+    }
+
+    if (exclude_kernel)
+        fprintf(stderr, "perf: counting user mode only\n");
+
+    ioctl(leader_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+    perf_enabled = 1;
+
+    return 0;
+}
+
+void perf_close(void)
+{
+    int ev;
+
+    if (leader_fd != -1)
+        ioctl(leader_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    for (ev = EV_COUNT - 1; ev >= 0; ev--)
+    {
+        if (event_fd[ev] != -1)
+            close(event_fd[ev]);
+
+        event_fd[ev] = -1;
+        event_slot[ev] = -1;
+    }
+
+    leader_fd = -1;
+    n_slots = 0;
+    perf_enabled = 0;
+}
+
+void perf_stage_begin(perf_stage stage)
+{
+    if (!perf_enabled)
+        return;
+
+    read_group(&begin_reading[stage]);
+    begin_ns[stage] = now_ns();
+}
+
+void perf_stage_end(perf_stage stage)
+{
+    const struct group_reading *begin = &begin_reading[stage];
+    struct group_reading end;
+    uint64_t enabled;
+    uint64_t running;
+    uint64_t end_ns;
+    int ev;
+
+    if (!perf_enabled)
+        return;
+
+    end_ns = now_ns();
+    read_group(&end);
+
+    enabled = end.enabled - begin->enabled;
+    running = end.running - begin->running;
+
+    for (ev = 0; ev < EV_COUNT; ev++)
+    {
+        uint64_t v = end.ev[ev] >= begin->ev[ev] ? end.ev[ev] - begin->ev[ev] : 0;
+
+        /* Scale up if the group did not own the PMU for the whole stage. */
+        if (running && running < enabled)
+            v = (uint64_t)((double)v * enabled / running);
+
+        frame[stage].ev[ev] += v;
+    }
+
+    frame[stage].ns += end_ns - begin_ns[stage];
+    frame[stage].runs++;
+}
+
+static double ratio(uint64_t a, uint64_t b)
+{
+    return b ? (double)a / b : 0.0;
+}
+
+void perf_frame_end(FILE * fp)
+{
+    int s;
+    int ev;
+
+    if (!perf_enabled)
+        return;
+
+    fprintf(fp, "frame %lu", n_frames);
+
+    for (s = 0; s < PERF_STAGE_COUNT; s++)
+    {
+        if (!frame[s].runs)
+            continue;
+
+        fprintf(fp, "  %s %.1fus ipc %.2f llc %llu dtlb %llu",
+                stage_names[s], frame[s].ns / 1000.0,
+                ratio(frame[s].ev[EV_INSTRUCTIONS], frame[s].ev[EV_CYCLES]),
+                (unsigned long long)frame[s].ev[EV_LLC_MISSES],
+                (unsigned long long)frame[s].ev[EV_DTLB_MISSES]);
+
+        total[s].ns += frame[s].ns;
+        for (ev = 0; ev < EV_COUNT; ev++)
+            total[s].ev[ev] += frame[s].ev[ev];
+        total[s].runs += frame[s].runs;
+
+        CLEAR(frame[s]);
+    }
+
+    fprintf(fp, "\n");
+
+    n_frames++;
+}
+
+static void print_count(FILE * fp, int ev, uint64_t value)
+{
+    if (event_slot[ev] < 0)
+        fprintf(fp, " %12s", "n/a");
+    else
+        fprintf(fp, " %12.0f", ratio(value, n_frames));
+}
+
+void perf_report(FILE * fp)
+{
+    int s;
+
+    if (!perf_enabled || !n_frames)
+        return;
+
+    fprintf(fp, "\n%lu frames, per frame averages:\n", n_frames);
+    fprintf(fp, "%-8s %10s %12s %12s %6s %12s %12s %8s\n",
+            "stage", "us", "cycles", "instr", "ipc",
+            "llc-miss", "dtlb-miss", "llc-mpki");
+
+    for (s = 0; s < PERF_STAGE_COUNT; s++)
+    {
+        if (!total[s].runs)
+            continue;
+
+        fprintf(fp, "%-8s %10.1f", stage_names[s],
+                ratio(total[s].ns, n_frames) / 1000.0);
+        print_count(fp, EV_CYCLES, total[s].ev[EV_CYCLES]);
+        print_count(fp, EV_INSTRUCTIONS, total[s].ev[EV_INSTRUCTIONS]);
+        fprintf(fp, " %6.2f", ratio(total[s].ev[EV_INSTRUCTIONS],
+                                    total[s].ev[EV_CYCLES]));
+        print_count(fp, EV_LLC_MISSES, total[s].ev[EV_LLC_MISSES]);
+        print_count(fp, EV_DTLB_MISSES, total[s].ev[EV_DTLB_MISSES]);
+        fprintf(fp, " %8.2f\n", 1000.0 * ratio(total[s].ev[EV_LLC_MISSES],
+                                               total[s].ev[EV_INSTRUCTIONS]));
+    }
+}
@@ -0,0 +1,40 @@
+/*
+ * Hardware performance counter profiling of the capture pipeline.
+ *
+ * Uses perf_event_open(2) to attribute cycles, instructions, last level
+ * cache misses and dTLB misses to each stage of a frame. Counters are
+ * read at stage boundaries and the deltas are accumulated per frame and
+ * over the whole run.
+ */
+
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <stdio.h>
+
+typedef enum
+{
+    PERF_STAGE_DEQUEUE,
+    PERF_STAGE_CONVERT,
+    PERF_STAGE_TRACK,
+    PERF_STAGE_RENDER,
+    PERF_STAGE_COUNT
+} perf_stage;
+
+/* Non-zero once perf_open() succeeded. Stage hooks are no-ops otherwise. */
+extern int perf_enabled;
+
+/* Returns 0 on success, -1 if no counter could be opened. */
+int perf_open(void);
+void perf_close(void);
+
+void perf_stage_begin(perf_stage stage);
+void perf_stage_end(perf_stage stage);
+
+/* Prints the counters of the frame just finished and folds them into the totals. */
+void perf_frame_end(FILE * fp);
+
+/* Prints per stage averages over all frames seen so far. */
+void perf_report(FILE * fp);
+
+#endif
@@ -0,0 +1,656 @@
+/*
+ * In-memory pre-event ring.
+ *
+ * Staging buffers are reference counted: a frame keeps its buffer until it
+ * has been compressed and, unless the next frame is a key frame, until the
+ * next frame has been diffed against it. Compressed frames are committed to
+ * the arena strictly in capture order, so the delta chain stays intact no
+ * matter which compressor finishes first.
+ *
+ * The arena is a circular log. New frames evict the oldest ones when they
+ * run out of room, exceed the time window or the index is full.
+ *
+ * A dump copies frames out of the arena without holding the ring lock, so
+ * compressors keep committing meanwhile. A frame's bytes are only reused
+ * after it has been evicted, so a frame still in the index once its copy
+ * is done was copied intact; frames evicted during the copy are left out.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <linux/videodev2.h>
+
+#include <zlib.h>
+
+#include "prering.h"
+#include "util.h"
+
+/* Upper bound on frame rate used to size the index. */
+#define PRERING_MAX_FPS 120
+
+struct stage
+{
+    uint8_t *data;
+    int users;
+};
+
+struct job
+{
+    unsigned int stage;
+    int ref;                    /* stage of the previous frame, -1 for key frames */
+    unsigned long seq;
+    uint64_t timestamp_us;
+};
+
+struct worker
+{
+    pthread_t thread;
+    z_stream zs;
+    uint8_t *delta;
+    uint8_t *out;
+    size_t out_size;
+};
+
+struct entry
+{
+    unsigned long seq;
+    uint64_t timestamp_us;
+    size_t offset;
+    uint32_t size;
+    uint32_t flags;
+};
+
+static size_t width;
+static size_t height;
+static size_t frame_bytes;
+static uint64_t window_us;
+
+/* Capture side: staging buffers and the compression queue. */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+static struct stage *stages = NULL;
+static unsigned int n_stages = 0;
+static struct job *jobs = NULL;
+static unsigned int job_head = 0;
+static unsigned int n_jobs = 0;
+static int last_stage = -1;
+static unsigned int since_key = 0;
+static unsigned long next_seq = 0;
+static unsigned long dropped = 0;
+static int stopping = 0;
+
+static struct worker *workers = NULL;
+static unsigned int n_workers = 0;
+
+/* Storage side: the arena and its index. */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+
+static uint8_t *arena = NULL;
+static size_t arena_size = 0;
+static size_t tail = 0;
+static struct entry *entries = NULL;
+static unsigned int max_entries = 0;
+static unsigned int entry_head = 0;
+static unsigned int n_entries = 0;
+static unsigned long next_commit = 0;
+static unsigned long first_live_seq = 0;
+static int chain_broken = 0;
+
+/* Dump thread and the buffers it copies the ring into. */
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t dump_thread;
+static int dump_running = 0;
+static int dump_stopping = 0;
+static unsigned int dump_requests = 0;
+static uint8_t *dump_data = NULL;
+static struct prering_file_entry *dump_index = NULL;
+static unsigned long *dump_seq = NULL;
+static unsigned long n_dumps = 0;
+
+static uint64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Called with job_lock held. */
+static void release_stage(int s)
+{
+    if (s >= 0)
+        stages[s].users--;
+}
+
+void prering_push(const uint8_t * yuyv, size_t stride)
+{
+    struct job *job;
+    unsigned int s;
+    size_t y;
+    int key;
+
+    pthread_mutex_lock(&job_lock);
+
+    for (s = 0; s < n_stages; s++)
+        if (!stages[s].users)
+            break;
+
+    if (s == n_stages)
+    {
+        dropped++;
+        pthread_mutex_unlock(&job_lock);
+        return;
+    }
+
+    /* One reference for our own compression, one for the next frame's delta. */
+    stages[s].users = 2;
+
+    pthread_mutex_unlock(&job_lock);
+
+    if (stride == width * 2)
+        memcpy(stages[s].data, yuyv, frame_bytes);
+    else
+        for (y = 0; y < height; y++)
+            memcpy(stages[s].data + y * width * 2, yuyv + y * stride, width * 2);
+
+    pthread_mutex_lock(&job_lock);
+
+    key = last_stage < 0 || since_key >= PRERING_KEY_INTERVAL - 1;
+
+    job = &jobs[(job_head + n_jobs) % n_stages];
+    job->stage = s;
+    job->seq = next_seq++;
+    job->timestamp_us = now_us();
+
+    if (key)
+    {
+        /* Nobody will diff against the previous frame any more. */
+        release_stage(last_stage);
+        job->ref = -1;
+        since_key = 0;
+    }
+    else
+    {
+        /* The reference reserved by the previous push moves to this job. */
+        job->ref = last_stage;
+        since_key++;
+    }
+
+    last_stage = s;
+    n_jobs++;
+
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+}
+
+static int compress_frame(struct worker *w, const uint8_t * data, uint32_t * size)
+{
+    deflateReset(&w->zs);
+
+    w->zs.next_in = (Bytef *) data;
+    w->zs.avail_in = frame_bytes;
+    w->zs.next_out = w->out;
+    w->zs.avail_out = w->out_size;
+
+    if (deflate(&w->zs, Z_FINISH) != Z_STREAM_END)
+        return -1;
+
+    *size = w->out_size - w->zs.avail_out;
+
+    return 0;
+}
+
+/* Pops the oldest frame from the index. Called with ring_lock held. */
+static void evict(void)
+{
+    first_live_seq = entries[entry_head].seq + 1;
+    entry_head = (entry_head + 1) % max_entries;
+    n_entries--;
+}
+
+static int overlaps(const struct entry *e, size_t pos, size_t size)
+{
+    return e->offset < pos + size && pos < e->offset + e->size;
+}
+
+/*
+ * Appends a compressed frame to the arena. A frame that is lost, NULL
+ * data or too big for the arena, breaks the delta chain: deltas are
+ * refused until the next key frame. Called with ring_lock held.
+ */
+static void commit(const struct job *job, const uint8_t * data, uint32_t size)
+{
+    struct entry *e;
+    size_t pos;
+
+    if (job->ref < 0)
+        chain_broken = 0;
+
+    if (!data || size > arena_size)
+        chain_broken = 1;
+
+    if (chain_broken)
+        return;
+
+    while (n_entries && job->timestamp_us - entries[entry_head].timestamp_us > window_us)
+        evict();
+
+    if (n_entries == max_entries)
+        evict();
+
+    pos = tail;
+
+    if (pos + size > arena_size)
+    {
+        /* Whatever lies past the tail predates everything at the start. */
+        while (n_entries && entries[entry_head].offset >= tail)
+            evict();
+
+        pos = 0;
+    }
+
+    while (n_entries && overlaps(&entries[entry_head], pos, size))
+        evict();
+
+    memcpy(arena + pos, data, size);
+
+    e = &entries[(entry_head + n_entries) % max_entries];
+    e->seq = job->seq;
+    e->timestamp_us = job->timestamp_us;
+    e->offset = pos;
+    e->size = size;
+    e->flags = job->ref < 0 ? PRERING_FLAG_KEY : 0;
+    n_entries++;
+
+    tail = pos + size;
+}
+
+static void *compress_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct job job;
+    const uint8_t *src;
+    uint32_t size = 0;
+    size_t i;
+    int r;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&job_lock);
+
+        while (!n_jobs && !stopping)
+            pthread_cond_wait(&job_cond, &job_lock);
+
+        if (!n_jobs)
+        {
+            pthread_mutex_unlock(&job_lock);
+            break;
+        }
+
+        job = jobs[job_head];
+        job_head = (job_head + 1) % n_stages;
+        n_jobs--;
+
+        pthread_mutex_unlock(&job_lock);
+
+        src = stages[job.stage].data;
+
+        if (job.ref >= 0)
+        {
+            const uint8_t *prev = stages[job.ref].data;
+
+            for (i = 0; i < frame_bytes; i++)
+                w->delta[i] = src[i] - prev[i];
+
+            src = w->delta;
+        }
+
+        r = compress_frame(w, src, &size);
+
+        pthread_mutex_lock(&job_lock);
+        release_stage(job.stage);
+        release_stage(job.ref);
+        pthread_mutex_unlock(&job_lock);
+
+        pthread_mutex_lock(&ring_lock);
+
+        while (next_commit != job.seq)
+            pthread_cond_wait(&commit_cond, &ring_lock);
+
+        /* A frame that failed to compress still takes its turn. */
+        commit(&job, 0 == r ? w->out : NULL, size);
+
+        next_commit++;
+        pthread_cond_broadcast(&commit_cond);
+        pthread_mutex_unlock(&ring_lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Copies the ring into the dump buffers. Only the index is read under
+ * ring_lock; frames are copied after dropping it and checked afterwards.
+ * Sets *first to the first frame to write, the oldest key frame whose
+ * chain survived the copy, and returns the number of frames copied.
+ */
+static uint32_t copy_ring(uint32_t * first)
+{
+    struct entry *e;
+    unsigned int i;
+    uint32_t n = 0;
+    uint32_t k;
+    size_t pos = 0;
+    int live;
+
+    pthread_mutex_lock(&ring_lock);
+
+    for (i = 0; i < n_entries; i++)
+    {
+        e = &entries[(entry_head + i) % max_entries];
+
+        /* Deltas whose key frame has been evicted cannot be decoded. */
+        if (!n && !(e->flags & PRERING_FLAG_KEY))
+            continue;
+
+        dump_index[n].timestamp_us = e->timestamp_us;
+        dump_index[n].offset = e->offset;
+        dump_index[n].size = e->size;
+        dump_index[n].flags = e->flags;
+        dump_seq[n] = e->seq;
+        n++;
+    }
+
+    pthread_mutex_unlock(&ring_lock);
+
+    *first = 0;
+
+    for (k = 0; k < n; k++)
+    {
+        memcpy(dump_data + pos, arena + dump_index[k].offset, dump_index[k].size);
+        dump_index[k].offset = pos;
+        pos += dump_index[k].size;
+
+        pthread_mutex_lock(&ring_lock);
+        live = dump_seq[k] >= first_live_seq;
+        pthread_mutex_unlock(&ring_lock);
+
+        /* Evicted while we copied, it and the deltas built on it are lost. */
+        if (!live)
+            *first = k + 1;
+    }
+
+    while (*first < n && !(dump_index[*first].flags & PRERING_FLAG_KEY))
+        (*first)++;
+
+    return n;
+}
+
+static void write_dump(void)
+{
+    struct prering_file_header header;
+    struct prering_file_entry *index;
+    const uint8_t *data;
+    char name[64];
+    struct tm tm;
+    struct timeval tv;
+    size_t data_size;
+    size_t len;
+    uint64_t base;
+    uint32_t first;
+    uint32_t n;
+    uint32_t i;
+    FILE *fp;
+
+    n = copy_ring(&first);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PRERING_MAGIC, sizeof(header.magic));
+    header.width = width;
+    header.height = height;
+    header.pixelformat = V4L2_PIX_FMT_YUYV;
+    header.n_frames = n - first;
+
+    if (!header.n_frames)
+        return;
+
+    index = dump_index + first;
+    data = dump_data + index[0].offset;
+    data_size = index[header.n_frames - 1].offset + index[header.n_frames - 1].size -
+                index[0].offset;
+
+    base = sizeof(header) + header.n_frames * sizeof(*index) - index[0].offset;
+    for (i = 0; i < header.n_frames; i++)
+        index[i].offset += base;
+
+    /* Microseconds and a count, so dumps within a second keep apart. */
+    gettimeofday(&tv, NULL);
+    localtime_r(&tv.tv_sec, &tm);
+    len = strftime(name, sizeof(name), "prering-%Y%m%d-%H%M%S", &tm);
+    snprintf(name + len, sizeof(name) - len, ".%06ld-%04lu.bin",
+             (long)tv.tv_usec, n_dumps++);
+
+    fp = fopen(name, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n", name, errno, strerror(errno));
+        return;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1
+        || fwrite(index, sizeof(*index), header.n_frames, fp) != header.n_frames
+        || fwrite(data, 1, data_size, fp) != data_size)
+        fprintf(stderr, "Cannot write '%s'\n", name);
+
+    fclose(fp);
+
+    fprintf(stderr, "%s: %u frames\n", name, header.n_frames);
+}
+
+static void *dump_thread_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&dump_lock);
+
+    for (;;)
+    {
+        while (!dump_requests && !dump_stopping)
+            pthread_cond_wait(&dump_cond, &dump_lock);
+
+        if (!dump_requests)
+            break;
+
+        /* Triggers that arrive while we are writing fold into one dump. */
+        dump_requests = 0;
+
+        pthread_mutex_unlock(&dump_lock);
+        write_dump();
+        pthread_mutex_lock(&dump_lock);
+    }
+
+    pthread_mutex_unlock(&dump_lock);
+
+    return NULL;
+}
+
+void prering_trigger(void)
+{
+    pthread_mutex_lock(&dump_lock);
+    dump_requests++;
+    pthread_cond_signal(&dump_cond);
+    pthread_mutex_unlock(&dump_lock);
+}
+
+unsigned long prering_dropped(void)
+{
+    unsigned long n;
+
+    pthread_mutex_lock(&job_lock);
+    n = dropped;
+    pthread_mutex_unlock(&job_lock);
+
+    return n;
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (!p)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return p;
+}
+
+int prering_init(size_t w, size_t h, unsigned int seconds,
+                 size_t budget, unsigned int n_threads)
+{
+    unsigned int i;
+
+    width = w;
+    height = h;
+    frame_bytes = w * h * 2;
+    window_us = (uint64_t)seconds * 1000000;
+
+    /* Half for the ring, half for the copy a dump is written from. */
+    arena_size = budget / 2;
+    arena = xmalloc(arena_size);
+    dump_data = xmalloc(arena_size);
+
+    max_entries = seconds * PRERING_MAX_FPS;
+    entries = xmalloc(max_entries * sizeof(*entries));
+    dump_index = xmalloc(max_entries * sizeof(*dump_index));
+    dump_seq = xmalloc(max_entries * sizeof(*dump_seq));
+
+    /* Each compressor holds two frames, plus one spare for the capture thread. */
+    n_stages = 2 * n_threads + 1;
+    stages = xmalloc(n_stages * sizeof(*stages));
+    jobs = xmalloc(n_stages * sizeof(*jobs));
+
+    for (i = 0; i < n_stages; i++)
+    {
+        stages[i].data = xmalloc(frame_bytes);
+        stages[i].users = 0;
+    }
+
+    workers = calloc(n_threads, sizeof(*workers));
+    if (!workers)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (n_workers = 0; n_workers < n_threads; n_workers++)
+    {
+        struct worker *wk = &workers[n_workers];
+
+        if (deflateInit(&wk->zs, Z_BEST_SPEED) != Z_OK)
+            break;
+
+        wk->out_size = deflateBound(&wk->zs, frame_bytes);
+        wk->out = xmalloc(wk->out_size);
+        wk->delta = xmalloc(frame_bytes);
+
+        if (start_worker(&wk->thread, compress_thread, wk))
+        {
+            deflateEnd(&wk->zs);
+            free(wk->out);
+            free(wk->delta);
+            break;
+        }
+    }
+
+    if (n_workers && 0 == start_worker(&dump_thread, dump_thread_main, NULL))
+        dump_running = 1;
+
+    if (!dump_running)
+    {
+        fprintf(stderr, "Cannot start pre-event ring threads\n");
+        prering_shutdown();
+        return -1;
+    }
+
+    return 0;
+}
+
+void prering_shutdown(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&job_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+
+    for (i = 0; i < n_workers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        deflateEnd(&workers[i].zs);
+        free(workers[i].out);
+        free(workers[i].delta);
+    }
+
+    /* Only now is the ring complete, let a pending dump see all of it. */
+    pthread_mutex_lock(&dump_lock);
+    dump_stopping = 1;
+    pthread_cond_broadcast(&dump_cond);
+    pthread_mutex_unlock(&dump_lock);
+
+    if (dump_running)
+        pthread_join(dump_thread, NULL);
+
+    for (i = 0; stages && i < n_stages; i++)
+        free(stages[i].data);
+
+    free(workers);
+    free(stages);
+    free(jobs);
+    free(entries);
+    free(dump_index);
+    free(dump_seq);
+    free(arena);
+    free(dump_data);
+
+    workers = NULL;
+    stages = NULL;
+    jobs = NULL;
+    entries = NULL;
+    dump_index = NULL;
+    dump_seq = NULL;
+    arena = NULL;
+    dump_data = NULL;
+    n_workers = 0;
+    n_stages = 0;
+    n_jobs = 0;
+    job_head = 0;
+    n_entries = 0;
+    entry_head = 0;
+    tail = 0;
+    last_stage = -1;
+    since_key = 0;
+    next_seq = 0;
+    next_commit = 0;
+    first_live_seq = 0;
+    chain_broken = 0;
+    dump_running = 0;
+    dump_stopping = 0;
+    dump_requests = 0;
+    stopping = 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * In-memory pre-event ring.
+ *
+ * Keeps the last few seconds of raw YUYV frames compressed in a fixed size
+ * arena so an incident can be saved together with what led up to it. The
+ * capture thread only copies the frame into a staging buffer; compression
+ * and dumping run on their own threads.
+ *
+ * Frames are stored as zlib (fastest level) streams. Every
+ * PRERING_KEY_INTERVAL-th frame is a key frame holding the image itself,
+ * the others hold the bytewise difference to the previous stored frame.
+ *
+ * Dump file layout, all integers little endian:
+ *
+ *   struct prering_file_header
+ *   struct prering_file_entry[n_frames]
+ *   compressed frame data, located by the entries
+ *
+ * The first frame in a dump is always a key frame.
+ */
+
+#ifndef PRERING_H
+#define PRERING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PRERING_MAGIC        "PRERING1"
+#define PRERING_KEY_INTERVAL 30
+
+#define PRERING_FLAG_KEY     1
+
+struct prering_file_header
+{
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixelformat;       /* V4L2 fourcc */
+    uint32_t n_frames;
+};
+
+struct prering_file_entry
+{
+    uint64_t timestamp_us;      /* wall clock, microseconds since the epoch */
+    uint64_t offset;            /* from the start of the file */
+    uint32_t size;
+    uint32_t flags;
+};
+
+/*
+ * Keeps up to seconds worth of width x height YUYV frames in compressed
+ * storage, using n_threads compressors. budget bytes are split between
+ * the ring and the copy dumps are written from; on top of that come
+ * 2 * n_threads + 1 raw frames of staging. Returns 0 on success.
+ */
+int prering_init(size_t width, size_t height, unsigned int seconds,
+                 size_t budget, unsigned int n_threads);
+
+/*
+ * Copies a frame with lines stride bytes apart into the ring. Never
+ * blocks on compression or disk.
+ */
+void prering_push(const uint8_t * yuyv, size_t stride);
+
+/* Asks the dump thread to write the current ring contents to a new file. */
+void prering_trigger(void);
+
+/* Frames skipped because every staging buffer was still being compressed. */
+unsigned long prering_dropped(void);
+
+/* Finishes pending compression and dumps, then frees everything. */
+void prering_shutdown(void);
+
+#endif
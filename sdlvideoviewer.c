@@ -2,7 +2,10 @@
  * Copyright (C) 2012 by Tomasz Moń <desowin@gmail.com>
  *
  * compile with:
- *   gcc -o sdlvideoviewer sdlvideoviewer.c -lSDL
+ *   gcc -O2 -o sdlvideoviewer sdlvideoviewer.c convert.c perfcounters.c \
+ *       snapshot.c prering.c deinterlace.c framestats.c filterchain.c denoise.c \
+ *       -L. -lcapture \
+ *       -lSDL -lpthread -lpng -ljpeg -lz
  *
  * Based on V4L2 video capture example
  *
@@ -25,6 +28,8 @@
  * in this Software without prior written authorization of the copyright holder.
  */
 
+#define _GNU_SOURCE
+
 #include <SDL/SDL.h>
 #include <assert.h>
 #include <stdint.h>
@@ -38,69 +43,157 @@
 #define __USE_BSD
 
 #include <getopt.h>             /* getopt_long() */
-#include <fcntl.h>              /* low-level i/o */
 #include <unistd.h>
 #include <errno.h>
-#include <malloc.h>
-#include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/time.h>
-#include <sys/mman.h>
-#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <time.h>
 
 #include <asm/types.h>          /* for videodev2.h */
 
 #include <linux/videodev2.h>
 
+#include "capture.h"
+#include "convert.h"
+#include "perfcounters.h"
+#include "snapshot.h"
+#include "prering.h"
+#include "deinterlace.h"
+#include "framestats.h"
+#include "filterchain.h"
+#include "denoise.h"
+#include "util.h"
+
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 
 #define max(a, b) (a > b ? a : b)
 #define min(a, b) (a > b ? b : a)
 
-typedef enum
-{
-    IO_METHOD_READ,
-    IO_METHOD_MMAP,
-    IO_METHOD_USERPTR,
-} io_method;
+static struct capture_config config = {
+    .dev_name = "/dev/video0",
+    .io = CAPTURE_IO_MMAP,
+    .pixelformat = V4L2_PIX_FMT_YUYV,
+    .field = V4L2_FIELD_ALTERNATE,  //V4L2_FIELD_INTERLACED;
+};
+static capture *cap = NULL;
 
-struct buffer
+static size_t WIDTH = 640;
+static size_t HEIGHT = 480;
+/* Lines per captured buffer, HEIGHT / 2 for alternate fields. */
+static size_t BUFFER_HEIGHT = 480;
+static void track_color(const struct filter_frame *frame, size_t step);
+static void reconfigure(size_t width, size_t height, capture_io io);
+static void check_pools(void);
+
+/* Sizes offered by the 'z' key. */
+static const struct
 {
-    void *start;
-    size_t length;
+    size_t width;
+    size_t height;
+} resolutions[] = {
+    {320, 240}, {640, 480}, {800, 600}, {1280, 720}, {1920, 1080}
 };
 
-static char *dev_name = NULL;
-static io_method io = IO_METHOD_MMAP;
-static int fd = -1;
-struct buffer *buffers = NULL;
-static unsigned int n_buffers = 0;
+#define N_RESOLUTIONS (sizeof(resolutions) / sizeof(resolutions[0]))
 
-static size_t WIDTH = 640;
-static size_t HEIGHT = 480;
-static void track_color(const void *p);
+/*
+ * Entry last asked for with 'z', -1 before the first press. Stepping by
+ * index rather than by the negotiated size keeps going when the driver
+ * clamps a request to a size it already has.
+ */
+static int resolution = -1;
+
+/* Set by reconfigure(), cleared once the first new frame is shown. */
+static uint64_t reconfigure_started = 0;
+static uint64_t reconfigure_stream = 0;
+static uint64_t last_frame_shown = 0;
+
+/* Field order negotiated with the driver, see capture_open(). */
+static enum v4l2_field field_order = V4L2_FIELD_NONE;
+static deinterlace_mode deinterlace = DEINTERLACE_ADAPTIVE;
+static int last_bottom = 1;
 
 static uint8_t *buffer_sdl;
 SDL_Surface *data_sf;
 
-static void errno_exit(const char *s)
+/* Frames per trigger, 0 while snapshots are disabled. */
+static unsigned int snapshot_burst = 0;
+static unsigned int snapshot_pending = 0;
+static volatile sig_atomic_t snapshot_signalled = 0;
+static int snapshot = 0;
+static unsigned int burst = 1;
+static snapshot_format snapshot_fmt = SNAPSHOT_PNG;
+
+static int prering_enabled = 0;
+static volatile sig_atomic_t prering_signalled = 0;
+static unsigned int prering_secs = 0;
+static size_t prering_mb = 64;
+
+/*
+ * Snapshot and pre-event pools of the previous frame size, left to finish
+ * their queued encodes and dumps on their own thread after a resize. New
+ * pools start once it is done.
+ */
+static pthread_t retire_thread;
+static int retiring = 0;
+static int retire_ring = 0;
+static int retire_done = 0;
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int stats_enabled = 0;
+static int stats_overlay = 0;
+static struct frame_stats frame_stats;
+static int stats_fresh = 0;
+static time_t stats_reported = 0;
+
+/* Region the stages after "crop" work on, width 0 when not cropping. */
+static struct
 {
-    fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
+    size_t width;
+    size_t height;
+    size_t x;
+    size_t y;
+} crop;
 
-    exit(EXIT_FAILURE);
-}
+static int denoise_enabled = 0;
+static unsigned int denoise_threshold = DENOISE_DEFAULT_THRESHOLD;
+
+/* Colour followed by the track stage. */
+static int track_enabled = 0;
+static uint8_t track_rgb[3];
 
-static int xioctl(int fd, int request, void *arg)
+#define TRACK_TOLERANCE 60      /* sum of absolute R, G, B differences */
+#define TRACK_MARKER 8
+
+/* Milliseconds per frame for the filter chain, negative to follow the camera. */
+static double budget_ms = -1;
+static uint64_t frame_interval = 0;
+static struct timeval last_timestamp;
+
+/*
+ * Startup phases in now_ns() time. The lookup table and the device are
+ * set up on their own threads while the main thread brings up SDL, so
+ * the phases overlap and are reported as durations.
+ */
+static struct
 {
-    int r;
+    uint64_t start;
+    uint64_t lut;               /* background */
+    uint64_t device;            /* open, format and buffers, background */
+    uint64_t stream_on;         /* background */
+    uint64_t display;
+    uint64_t lut_wait;          /* main thread blocked on the table */
+    int reported;
+} startup;
 
-    do
-    {
-        r = ioctl(fd, request, arg);
-    }
-    while (-1 == r && EINTR == errno);
+static void errno_exit(const char *s)
+{
+    fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
 
-    return r;
+    exit(EXIT_FAILURE);
 }
 
 static void render(SDL_Surface * sf)
@@ -110,715 +203,858 @@ static void render(SDL_Surface * sf)
         SDL_UpdateRect(screen, 0, 0, 0, 0);
 }
 
-void YCbCrToRGB(int y, int cb, int cr, uint8_t * r, uint8_t * g, uint8_t * b)
-{
-    double Y = (double)y;
-    double Cb = (double)cb;
-    double Cr = (double)cr;
+static int lut_ready = 0;
 
-    int R = (int)(Y + 1.40200 * (Cr - 0x80));
-    int G = (int)(Y - 0.34414 * (Cb - 0x80) - 0.71414 * (Cr - 0x80));
-    int B = (int)(Y + 1.77200 * (Cb - 0x80));
+/* lut_wait(), recording how long the table took and how long we waited. */
+static void startup_lut_wait(void)
+{
+    uint64_t t = now_ns();
 
-    *r = max(0, min(255, R));
-    *g = max(0, min(255, G));
-    *b = max(0, min(255, B));
+    startup.lut = lut_wait() - startup.lut;
+    startup.lut_wait = now_ns() - t;
+    lut_ready = 1;
 }
 
-/* 
- * YCbCr to RGB lookup table
+/*
+ * Converts a captured buffer with lines stride bytes apart into buffer_sdl.
  *
- * Indexes are [Y][Cb][Cr]
- * Y, Cb, Cr range is 0-255
- *
- * Stored value bits:
- *   24-16 Red
- *   15-8  Green
- *   7-0   Blue
+ * field is the buf.field the driver reported. With V4L2_FIELD_ALTERNATE
+ * each buffer holds a single field of BUFFER_HEIGHT lines which is
+ * deinterlaced to a full frame of HEIGHT lines, anything else is shown
+ * as it is.
  */
-uint32_t YCbCr_to_RGB[256][256][256];
-
-static void generate_YCbCr_to_RGB_lookup()
+static void convert_frame(const uint8_t * buffer_yuv, size_t stride,
+                          enum v4l2_field field, int with_stats)
 {
-    int y;
-    int cb;
-    int cr;
+    deinterlace_row_fn convert = YUV422_row_to_RGB;
+    size_t y;
+
+    if (with_stats && 0 == framestats_begin(WIDTH))
+        convert = YUV422_row_to_RGB_stats;
 
-    for (y = 0; y < 256; y++)
+    if (field_order == V4L2_FIELD_ALTERNATE)
     {
-        for (cb = 0; cb < 256; cb++)
+        deinterlace_mode mode = deinterlace;
+
+        /*
+         * read() does not tell the parity, assume fields alternate. The
+         * guess is wrong after a dropped field, so only bob is safe.
+         */
+        if (field == V4L2_FIELD_TOP)
+            last_bottom = 0;
+        else if (field == V4L2_FIELD_BOTTOM)
+            last_bottom = 1;
+        else
         {
-            for (cr = 0; cr < 256; cr++)
-            {
-                double Y = (double)y;
-                double Cb = (double)cb;
-                double Cr = (double)cr;
-
-                int R = (int)(Y+1.40200*(Cr - 0x80));
-                int G = (int)(Y-0.34414*(Cb - 0x80)-0.71414*(Cr - 0x80));
-                int B = (int)(Y+1.77200*(Cb - 0x80));
+            last_bottom = !last_bottom;
+            mode = DEINTERLACE_BOB;
+        }
 
-                R = max(0, min(255, R));
-                G = max(0, min(255, G));
-                B = max(0, min(255, B));
+        deinterlace_field(buffer_sdl, buffer_yuv, stride, last_bottom,
+                          mode, convert);
+    }
+    else
+    {
+        for (y = 0; y < HEIGHT; y++)
+            convert(buffer_sdl + y * WIDTH * 3, buffer_yuv + y * stride, WIDTH);
+    }
 
-                YCbCr_to_RGB[y][cb][cr] = R << 16 | G << 8 | B;
-            }
-        }
+    if (convert == YUV422_row_to_RGB_stats)
+    {
+        framestats_end(&frame_stats);
+        stats_fresh = 1;
     }
 }
 
-#define COLOR_GET_RED(color)   ((color >> 16) & 0xFF)
-#define COLOR_GET_GREEN(color) ((color >> 8) & 0xFF)
-#define COLOR_GET_BLUE(color)  (color & 0xFF)
-
-/**
- *  Converts YUV422 to RGB
- *  Before first use call generate_YCbCr_to_RGB_lookup();
- *
- *  input is pointer to YUV422 encoded data in following order: Y0, Cb, Y1, Cr.
- *  output is pointer to 24 bit RGB buffer.
- *  Output data is written in following order: R1, G1, B1, R2, G2, B2.
- */
-static void inline YUV422_to_RGB(uint8_t * output, const uint8_t * input)
+/* One line per second: min/mean/max and clipped low/high percentages per channel. */
+static void report_stats(FILE * fp)
 {
-    uint8_t y0 = input[0];
-    uint8_t cb = input[1];
-    uint8_t y1 = input[2];
-    uint8_t cr = input[3];
+    static const char names[FRAMESTATS_CHANNELS] = { 'Y', 'R', 'G', 'B' };
+    const struct frame_stats *st = &frame_stats;
+    int c;
 
-    uint32_t rgb = YCbCr_to_RGB[y0][cb][cr];
-    output[0] = COLOR_GET_RED(rgb);
-    output[1] = COLOR_GET_GREEN(rgb);
-    output[2] = COLOR_GET_BLUE(rgb);
+    if (!st->pixels)
+        return;
 
-    rgb = YCbCr_to_RGB[y1][cb][cr];
-    output[3] = COLOR_GET_RED(rgb);
-    output[4] = COLOR_GET_GREEN(rgb);
-    output[5] = COLOR_GET_BLUE(rgb);
+    fprintf(fp, "stats:");
 
+    for (c = 0; c < FRAMESTATS_CHANNELS; c++)
+        fprintf(fp, " %c %u/%.1f/%u clip %.2f%%/%.2f%%", names[c],
+                st->min[c], st->mean[c], st->max[c],
+                100.0 * st->clipped_low[c] / st->pixels,
+                100.0 * st->clipped_high[c] / st->pixels);
 
+    fprintf(fp, " focus %.1f\n", st->focus);
 }
 
-static void process_image(const void *p)
+/* History parity for alternate fields, guessed like convert_frame() does. */
+static int field_parity(enum v4l2_field field)
 {
-    const uint8_t *buffer_yuv = p;
-
-    size_t x;
-    size_t y;
+    if (field_order != V4L2_FIELD_ALTERNATE)
+        return 0;
 
-    for (y = 0; y < HEIGHT; y++)
-        for (x = 0; x < WIDTH; x += 2)
-            YUV422_to_RGB(buffer_sdl + (y * WIDTH + x) * 3,
-                          buffer_yuv + (y * WIDTH + x) * 2);
+    if (field == V4L2_FIELD_TOP || field == V4L2_FIELD_BOTTOM)
+        return field == V4L2_FIELD_BOTTOM;
 
-//    track_color(&buffer_yuv);
-    render(data_sf);
+    return !last_bottom;
 }
 
-
-static void  track_color(const void *p)
+/*
+ * Filter chain stages. Statistics are gathered inside the conversion, so
+ * dropping them is the degraded variant of convert.
+ */
+static int convert_stage(const struct filter_frame *in, struct filter_frame *out)
 {
+    perf_stage_begin(PERF_STAGE_CONVERT);
+    convert_frame(in->data, in->stride, in->field, stats_enabled);
+    perf_stage_end(PERF_STAGE_CONVERT);
 
-    size_t x;
-    size_t y;
-    const uint8_t *buffer_track = p;
-
-    for (y = 0; y < HEIGHT; y++)
-        for (x = 0; x < WIDTH; x += 2)
-            YUV422_to_RGB(buffer_sdl + (y * WIDTH + x) * 3,
-                          buffer_track + (y * WIDTH + x) * 2);
+    out->data = buffer_sdl;
+    out->width = WIDTH;
+    out->height = HEIGHT;
+    out->stride = WIDTH * 3;
 
-	render(data_sf);
+    return 0;
 }
 
+static int convert_stage_plain(const struct filter_frame *in,
+                               struct filter_frame *out)
+{
+    perf_stage_begin(PERF_STAGE_CONVERT);
+    convert_frame(in->data, in->stride, in->field, 0);
+    perf_stage_end(PERF_STAGE_CONVERT);
 
+    out->data = buffer_sdl;
+    out->width = WIDTH;
+    out->height = HEIGHT;
+    out->stride = WIDTH * 3;
 
-static int read_frame(void)
+    return 0;
+}
+
+/* Leaves the driver's buffer alone, the result is the denoise history. */
+static int denoise_stage(const struct filter_frame *in, struct filter_frame *out)
 {
-    struct v4l2_buffer buf;
-    unsigned int i;
+    out->data = (uint8_t *)denoise_frame(in->data, in->stride,
+                                         field_parity(in->field));
+    out->stride = WIDTH * 2;
 
-    switch (io)
-    {
-    case IO_METHOD_READ:
-        if (-1 == read(fd, buffers[0].start, buffers[0].length))
-        {
-            switch (errno)
-            {
-            case EAGAIN:
-                return 0;
+    return 0;
+}
 
-            case EIO:
-                /* Could ignore EIO, see spec. */
+/* Narrows the frame to the crop region without copying. */
+static int crop_stage(const struct filter_frame *in, struct filter_frame *out)
+{
+    size_t x = min(crop.x, in->width);
+    size_t y = min(crop.y, in->height);
 
-                /* fall through */
+    out->data = in->data + y * in->stride + x * 3;
+    out->width = min(crop.width, in->width - x);
+    out->height = min(crop.height, in->height - y);
 
-            default:
-                errno_exit("read");
-            }
-        }
+    return 0;
+}
 
-        process_image(buffers[0].start);
+static int track_stage(const struct filter_frame *in, struct filter_frame *out)
+{
+    (void)out;
 
-        break;
+    perf_stage_begin(PERF_STAGE_TRACK);
+    track_color(in, 1);
+    perf_stage_end(PERF_STAGE_TRACK);
 
-    case IO_METHOD_MMAP:
-        CLEAR(buf);
+    return 0;
+}
 
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
+/* Looks at every fourth pixel of every fourth line only. */
+static int track_stage_coarse(const struct filter_frame *in,
+                              struct filter_frame *out)
+{
+    (void)out;
 
-        if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
-        {
-            switch (errno)
-            {
-            case EAGAIN:
-                return 0;
+    perf_stage_begin(PERF_STAGE_TRACK);
+    track_color(in, 4);
+    perf_stage_end(PERF_STAGE_TRACK);
 
-            case EIO:
-                /* Could ignore EIO, see spec. */
+    return 0;
+}
 
-                /* fall through */
+static int overlay_stage(const struct filter_frame *in, struct filter_frame *out)
+{
+    (void)out;
 
-            default:
-                errno_exit("VIDIOC_DQBUF");
-            }
-        }
+    /* Nothing to draw if the budget dropped statistics from this frame. */
+    if (stats_overlay && stats_fresh)
+        framestats_draw(in->data, in->width, in->height, in->stride,
+                        &frame_stats);
+
+    return 0;
+}
 
-        assert(buf.index < n_buffers);
+/* Shows the whole converted frame, whatever region the stages before worked on. */
+static int render_stage(const struct filter_frame *in, struct filter_frame *out)
+{
+    (void)in;
+    (void)out;
 
-        process_image(buffers[buf.index].start);
+    perf_stage_begin(PERF_STAGE_RENDER);
+    render(data_sf);
+    perf_stage_end(PERF_STAGE_RENDER);
 
-        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-            errno_exit("VIDIOC_QBUF");
+    return 0;
+}
 
-        break;
+static const struct filter_stage denoise_filter = {
+    "denoise", FILTER_YUYV, FILTER_YUYV, 0, 0, denoise_stage, NULL
+};
 
-    case IO_METHOD_USERPTR:
-        CLEAR(buf);
+static const struct filter_stage convert_filter = {
+    "convert", FILTER_YUYV, FILTER_RGB24, 0, 0, convert_stage, NULL
+};
 
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_USERPTR;
+static const struct filter_stage convert_stats_filter = {
+    "convert", FILTER_YUYV, FILTER_RGB24, 0, 0, convert_stage, convert_stage_plain
+};
 
-        if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
-        {
-            switch (errno)
-            {
-            case EAGAIN:
-                return 0;
+static const struct filter_stage crop_filter = {
+    "crop", FILTER_RGB24, FILTER_RGB24, 1, 0, crop_stage, NULL
+};
 
-            case EIO:
-                /* Could ignore EIO, see spec. */
+static const struct filter_stage track_filter = {
+    "track", FILTER_RGB24, FILTER_RGB24, 1, 1, track_stage, track_stage_coarse
+};
 
-                /* fall through */
+static const struct filter_stage overlay_filter = {
+    "overlay", FILTER_RGB24, FILTER_RGB24, 1, 1, overlay_stage, NULL
+};
 
-            default:
-                errno_exit("VIDIOC_DQBUF");
-            }
-        }
+static const struct filter_stage render_filter = {
+    "render", FILTER_RGB24, FILTER_RGB24, 1, 0, render_stage, NULL
+};
 
-        for (i = 0; i < n_buffers; ++i)
-            if (buf.m.userptr == (unsigned long)buffers[i].start
-                && buf.length == buffers[i].length)
-                break;
+/* Registers the stages the command line asked for, in processing order. */
+static void init_filter_chain(void)
+{
+    if ((denoise_enabled && -1 == filterchain_add(&denoise_filter))
+        || -1 == filterchain_add(stats_enabled ? &convert_stats_filter : &convert_filter)
+        || (crop.width && -1 == filterchain_add(&crop_filter))
+        || (track_enabled && -1 == filterchain_add(&track_filter))
+        || (stats_enabled && -1 == filterchain_add(&overlay_filter))
+        || -1 == filterchain_add(&render_filter))
+        exit(EXIT_FAILURE);
 
-        assert(i < n_buffers);
+    if (budget_ms >= 0)
+        filterchain_set_budget(budget_ms * 1e6);
+}
 
-        process_image((void *)buf.m.userptr);
+/*
+ * Follows the interval between driver timestamps. The chain gets 90% of
+ * it, the rest is left for dequeueing and event handling.
+ */
+static void update_budget(const struct timeval *timestamp)
+{
+    int64_t dt = (timestamp->tv_sec - last_timestamp.tv_sec) * 1000000000ll +
+                 (timestamp->tv_usec - last_timestamp.tv_usec) * 1000ll;
 
-        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-            errno_exit("VIDIOC_QBUF");
+    last_timestamp = *timestamp;
 
-        break;
-    }
+    /* Ignore the first frame and gaps from reconfiguring or stalls. */
+    if (dt <= 0 || dt > 1000000000ll)
+        return;
 
-    return 1;
+    frame_interval = frame_interval ? frame_interval - frame_interval / 8 + dt / 8
+                                    : (uint64_t)dt;
+    filterchain_set_budget(frame_interval * 9 / 10);
 }
 
-static void mainloop(void)
+static void process_image(const void *p, size_t stride, enum v4l2_field field)
 {
-    SDL_Event event;
-    for (;;)
-    {
+    struct filter_frame frame;
 
-        while (SDL_PollEvent(&event))
-            if (event.type == SDL_QUIT)
-                return;
+    if (prering_enabled)
+        prering_push(p, stride);
 
+    frame.data = (uint8_t *)p;
+    frame.width = WIDTH;
+    frame.height = BUFFER_HEIGHT;
+    frame.stride = stride;
+    frame.format = FILTER_YUYV;
+    frame.field = field;
 
-        for (;;)
-        {
-            fd_set fds;
-            struct timeval tv;
-            int r;
+    stats_fresh = 0;
 
-            FD_ZERO(&fds);
-            FD_SET(fd, &fds);
+    if (-1 == filterchain_run(&frame))
+        exit(EXIT_FAILURE);
 
-            /* Timeout. */
-            tv.tv_sec = 2;
-            tv.tv_usec = 0;
+    /* Statistics go to stdout once a second, the histogram on every frame. */
+    if (stats_fresh && time(NULL) != stats_reported)
+    {
+        stats_reported = time(NULL);
+        report_stats(stdout);
+    }
 
-            r = select(fd + 1, &fds, NULL, NULL, &tv);
+    /* Hand the finished frame to the encoders and convert into a spare one. */
+    if (snapshot_pending)
+    {
+        snapshot_pending--;
+        buffer_sdl = snapshot_submit(buffer_sdl);
+        data_sf->pixels = buffer_sdl;
+    }
+}
 
-            if (-1 == r)
-            {
-                if (EINTR == errno)
-                    continue;
+/*
+ * Marks the centroid of the pixels close to track_rgb, looking at every
+ * step-th pixel of every step-th line.
+ */
+static void track_color(const struct filter_frame *frame, size_t step)
+{
+    uint64_t sum_x = 0;
+    uint64_t sum_y = 0;
+    uint32_t n = 0;
+    size_t x;
+    size_t y;
+    size_t cx;
+    size_t cy;
 
-                errno_exit("select");
-            }
+    for (y = 0; y < frame->height; y += step)
+    {
+        const uint8_t *p = frame->data + y * frame->stride;
 
-            if (0 == r)
+        for (x = 0; x < frame->width; x += step)
+        {
+            const uint8_t *px = p + x * 3;
+
+            if (abs(px[0] - track_rgb[0]) + abs(px[1] - track_rgb[1]) +
+                abs(px[2] - track_rgb[2]) <= TRACK_TOLERANCE)
             {
-                fprintf(stderr, "select timeout\n");
-                exit(EXIT_FAILURE);
+                sum_x += x;
+                sum_y += y;
+                n++;
             }
-
-            if (read_frame())
-                break;
-
-            /* EAGAIN - continue select loop. */
         }
     }
-}
 
-static void stop_capturing(void)
-{
-    enum v4l2_buf_type type;
+    if (!n)
+        return;
 
-    switch (io)
+    cx = sum_x / n;
+    cy = sum_y / n;
+
+    /* Crosshair in inverted colour so it stays visible on the target. */
+    for (x = cx > TRACK_MARKER ? cx - TRACK_MARKER : 0;
+         x <= cx + TRACK_MARKER && x < frame->width; x++)
     {
-    case IO_METHOD_READ:
-        /* Nothing to do. */
-        break;
+        uint8_t *px = frame->data + cy * frame->stride + x * 3;
 
-    case IO_METHOD_MMAP:
-    case IO_METHOD_USERPTR:
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        px[0] = ~track_rgb[0];
+        px[1] = ~track_rgb[1];
+        px[2] = ~track_rgb[2];
+    }
 
-        if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
-            errno_exit("VIDIOC_STREAMOFF");
+    for (y = cy > TRACK_MARKER ? cy - TRACK_MARKER : 0;
+         y <= cy + TRACK_MARKER && y < frame->height; y++)
+    {
+        uint8_t *px = frame->data + y * frame->stride + cx * 3;
 
-        break;
+        px[0] = ~track_rgb[0];
+        px[1] = ~track_rgb[1];
+        px[2] = ~track_rgb[2];
     }
 }
 
-static void start_capturing(void)
+static int read_frame(void)
 {
-    unsigned int i;
-    enum v4l2_buf_type type;
+    struct capture_frame frame;
+    int r;
 
-    switch (io)
-    {
-    case IO_METHOD_READ:
-        /* Nothing to do. */
-        break;
+    perf_stage_begin(PERF_STAGE_DEQUEUE);
+    r = capture_borrow(cap, &frame);
+    perf_stage_end(PERF_STAGE_DEQUEUE);
 
-    case IO_METHOD_MMAP:
-        for (i = 0; i < n_buffers; ++i)
-        {
-            struct v4l2_buffer buf;
+    if (-1 == r)
+        exit(EXIT_FAILURE);
 
-            CLEAR(buf);
+    if (0 == r)
+        return 0;
 
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory = V4L2_MEMORY_MMAP;
-            buf.index = i;
+    if (!lut_ready)
+        startup_lut_wait();
 
-            if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-                errno_exit("VIDIOC_QBUF");
-        }
+    if (budget_ms < 0)
+        update_budget(&frame.timestamp);
 
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    process_image(frame.data, frame.stride, frame.field);
 
-        if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
-            errno_exit("VIDIOC_STREAMON");
+    if (-1 == capture_release(cap, &frame))
+        exit(EXIT_FAILURE);
 
-        break;
+    if (!startup.reported)
+    {
+        fprintf(stderr, "First frame shown after %.1f ms\n"
+                "  lookup table %6.1f ms, %.1f ms of it waited for\n"
+                "  device open  %6.1f ms\n"
+                "  stream on    %6.1f ms\n"
+                "  display      %6.1f ms\n",
+                (now_ns() - startup.start) / 1e6,
+                startup.lut / 1e6, startup.lut_wait / 1e6,
+                startup.device / 1e6, startup.stream_on / 1e6,
+                startup.display / 1e6);
+        startup.reported = 1;
+    }
 
-    case IO_METHOD_USERPTR:
-        for (i = 0; i < n_buffers; ++i)
-        {
-            struct v4l2_buffer buf;
+    if (reconfigure_started)
+    {
+        uint64_t now = now_ns();
 
-            CLEAR(buf);
+        fprintf(stderr, "%zux%zu: stream off to on %.1f ms, first frame %.1f ms "
+                "after the request, display gap %.1f ms\n",
+                WIDTH, HEIGHT, reconfigure_stream / 1e6,
+                (now - reconfigure_started) / 1e6, (now - last_frame_shown) / 1e6);
+        reconfigure_started = 0;
+    }
 
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory = V4L2_MEMORY_USERPTR;
-            buf.index = i;
-            buf.m.userptr = (unsigned long)buffers[i].start;
-            buf.length = buffers[i].length;
+    last_frame_shown = now_ns();
 
-            if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-                errno_exit("VIDIOC_QBUF");
-        }
+    perf_frame_end(stdout);
 
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    return 1;
+}
 
-        if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
-            errno_exit("VIDIOC_STREAMON");
+static void snapshot_signal(int sig)
+{
+    (void)sig;
+    snapshot_signalled = 1;
+}
 
-        break;
-    }
+static void prering_signal(int sig)
+{
+    (void)sig;
+    prering_signalled = 1;
 }
 
-static void uninit_device(void)
+static void handle_key(SDLKey key)
 {
-    unsigned int i;
+    size_t i;
+    capture_io io;
 
-    switch (io)
+    switch (key)
     {
-    case IO_METHOD_READ:
-        free(buffers[0].start);
+    case SDLK_s:
+        snapshot_pending += snapshot_burst;
         break;
 
-    case IO_METHOD_MMAP:
-        for (i = 0; i < n_buffers; ++i)
-            if (-1 == munmap(buffers[i].start, buffers[i].length))
-                errno_exit("munmap");
+    case SDLK_e:
+        if (prering_enabled)
+            prering_trigger();
         break;
 
-    case IO_METHOD_USERPTR:
-        for (i = 0; i < n_buffers; ++i)
-            free(buffers[i].start);
+    case SDLK_i:
+        deinterlace = (deinterlace + 1) % DEINTERLACE_COUNT;
+        fprintf(stderr, "deinterlace: %s\n", deinterlace_mode_name(deinterlace));
         break;
-    }
 
-    free(buffers);
-}
+    case SDLK_o:
+        stats_overlay = !stats_overlay;
+        break;
 
-static void init_read(unsigned int buffer_size)
-{
-    buffers = calloc(1, sizeof(*buffers));
+    case SDLK_z:
+        if (resolution < 0)
+        {
+            /* First press, the next size up from the startup one. */
+            for (i = 0; i < N_RESOLUTIONS; i++)
+                if (resolutions[i].width * resolutions[i].height > WIDTH * HEIGHT)
+                    break;
 
-    if (!buffers)
-    {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
+            resolution = i % N_RESOLUTIONS;
+        }
+        else
+        {
+            /* Back to the smallest after the largest. */
+            resolution = (resolution + 1) % N_RESOLUTIONS;
+        }
 
-    buffers[0].length = buffer_size;
-    buffers[0].start = malloc(buffer_size);
+        reconfigure(resolutions[resolution].width, resolutions[resolution].height,
+                    config.io);
+        break;
 
-    if (!buffers[0].start)
-    {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
+    case SDLK_m:
+        io = config.io;
+
+        /* Next method the device supports, the current one if none. */
+        do
+            io = (io + 1) % (CAPTURE_IO_USERPTR + 1);
+        while (io != config.io && !capture_supports(cap, io));
+
+        if (io != config.io)
+            reconfigure(WIDTH, HEIGHT, io);
+        break;
+
+    default:
+        break;
     }
 }
 
-static void init_mmap(void)
+static void mainloop(void)
 {
-    struct v4l2_requestbuffers req;
+    SDL_Event event;
+    for (;;)
+    {
 
-    CLEAR(req);
+        while (SDL_PollEvent(&event))
+        {
+            if (event.type == SDL_QUIT)
+                return;
 
-    req.count = 4;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+            if (event.type == SDL_KEYDOWN)
+                handle_key(event.key.keysym.sym);
+        }
 
-    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req))
-    {
-        if (EINVAL == errno)
+        if (snapshot_signalled)
         {
-            fprintf(stderr, "%s does not support "
-                    "memory mapping\n", dev_name);
-            exit(EXIT_FAILURE);
+            snapshot_signalled = 0;
+            snapshot_pending += snapshot_burst;
         }
-        else
+
+        if (prering_signalled)
         {
-            errno_exit("VIDIOC_REQBUFS");
+            prering_signalled = 0;
+            if (prering_enabled)
+                prering_trigger();
         }
-    }
 
-    if (req.count < 2)
-    {
-        fprintf(stderr, "Insufficient buffer memory on %s\n", dev_name);
-        exit(EXIT_FAILURE);
-    }
+        check_pools();
 
-    buffers = calloc(req.count, sizeof(*buffers));
 
-    if (!buffers)
-    {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
+        for (;;)
+        {
+            int fd = capture_fd(cap);
+            fd_set fds;
+            struct timeval tv;
+            int r;
 
-    for (n_buffers = 0; n_buffers < req.count; ++n_buffers)
-    {
-        struct v4l2_buffer buf;
+            FD_ZERO(&fds);
+            FD_SET(fd, &fds);
 
-        CLEAR(buf);
+            /* Timeout. */
+            tv.tv_sec = 2;
+            tv.tv_usec = 0;
 
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = n_buffers;
+            r = select(fd + 1, &fds, NULL, NULL, &tv);
 
-        if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
-            errno_exit("VIDIOC_QUERYBUF");
+            if (-1 == r)
+            {
+                if (EINTR == errno)
+                    continue;
+
+                errno_exit("select");
+            }
+
+            if (0 == r)
+            {
+                fprintf(stderr, "select timeout\n");
+                exit(EXIT_FAILURE);
+            }
 
-        buffers[n_buffers].length = buf.length;
-        buffers[n_buffers].start = mmap(NULL /* start anywhere */ ,
-                                        buf.length, PROT_READ | PROT_WRITE  /* required 
-                                                                             */ ,
-                                        MAP_SHARED /* recommended */ ,
-                                        fd, buf.m.offset);
+            if (read_frame())
+                break;
 
-        if (MAP_FAILED == buffers[n_buffers].start)
-            errno_exit("mmap");
+            /* EAGAIN - continue select loop. */
+        }
     }
 }
 
-static void init_userp(unsigned int buffer_size)
+static void usage(FILE * fp, int argc, char **argv)
 {
-    struct v4l2_requestbuffers req;
-    unsigned int page_size;
+    fprintf(fp,
+            "Usage: %s [options]\n\n"
+            "Options:\n"
+            "-d | --device name   Video device name [/dev/video]\n"
+            "-h | --help          Print this message\n"
+            "-m | --mmap          Use memory mapped buffers\n"
+            "-r | --read          Use read() calls\n"
+            "-u | --userp         Use application allocated buffers\n"
+            "-x | --width         Video width\n"
+            "-y | --height        Video height\n"
+            "-p | --perf          Report hardware counters per pipeline stage\n"
+            "-s | --snapshot fmt  Enable snapshots (ppm, png, jpg) on 's' or SIGUSR1\n"
+            "-n | --burst count   Frames saved per snapshot trigger [1]\n"
+            "-e | --prering secs  Keep the last secs of video, dump on 'e' or SIGUSR2\n"
+            "-M | --prering-mb mb Memory for the pre-event ring, half of it kept for\n"
+            "                     the dump copy, plus 5 raw frames of staging [64]\n"
+            "-i | --deinterlace m Deinterlacer for alternate fields: weave, bob,\n"
+            "                     adaptive [adaptive], 'i' cycles\n"
+            "-S | --stats         Print image statistics, 'o' toggles histogram\n"
+            "-D | --denoise thr   Temporal noise reduction, bytes changing by more\n"
+            "                     than thr count as motion [10]\n"
+            "-c | --crop WxH+X+Y  Limit tracking and the histogram to a region\n"
+            "-t | --track RRGGBB  Mark where the given colour is in the picture\n"
+            "-B | --budget ms     Processing time per frame before optional stages\n"
+            "                     are cut, 0 for none [90%% of the frame interval]\n"
+            "\n"
+            "While running 'z' steps through sizes up to 1920x1080 and 'm' through\n"
+            "the i/o methods without restarting.\n"
+             "", argv[0]);
+}
 
-    page_size = getpagesize();
-    buffer_size = (buffer_size + page_size - 1) & ~(page_size - 1);
+static const char short_options[] = "d:hmrux:y:ps:n:e:M:i:SD:c:t:B:";
 
-    CLEAR(req);
+static const struct option long_options[] = {
+    {"device", required_argument, NULL, 'd'},
+    {"help", no_argument, NULL, 'h'},
+    {"mmap", no_argument, NULL, 'm'},
+    {"read", no_argument, NULL, 'r'},
+    {"userp", no_argument, NULL, 'u'},
+    {"width", required_argument, NULL, 'x'},
+    {"height", required_argument, NULL, 'y'},
+    {"perf", no_argument, NULL, 'p'},
+    {"snapshot", required_argument, NULL, 's'},
+    {"burst", required_argument, NULL, 'n'},
+    {"prering", required_argument, NULL, 'e'},
+    {"prering-mb", required_argument, NULL, 'M'},
+    {"deinterlace", required_argument, NULL, 'i'},
+    {"stats", no_argument, NULL, 'S'},
+    {"denoise", required_argument, NULL, 'D'},
+    {"crop", required_argument, NULL, 'c'},
+    {"track", required_argument, NULL, 't'},
+    {"budget", required_argument, NULL, 'B'},
+    {0, 0, 0, 0}
+};
 
-    req.count = 4;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_USERPTR;
+static int sdl_filter(const SDL_Event * event)
+{
+    return event->type == SDL_QUIT || event->type == SDL_KEYDOWN;
+}
 
-    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req))
-    {
-        if (EINVAL == errno)
-        {
-            fprintf(stderr, "%s does not support "
-                    "user pointer i/o\n", dev_name);
-            exit(EXIT_FAILURE);
-        }
-        else
-        {
-            errno_exit("VIDIOC_REQBUFS");
-        }
-    }
+#define mask32(BYTE) (*(uint32_t *)(uint8_t [4]){ [BYTE] = 0xff })
 
-    buffers = calloc(4, sizeof(*buffers));
+/* Starts the snapshot and pre-event pools for the current frame size. */
+static void start_pools(void)
+{
+    /*
+     * Two encoders and enough spare frames to absorb a whole burst while
+     * they catch up.
+     */
+    if (snapshot && 0 == snapshot_init(WIDTH, HEIGHT, snapshot_fmt,
+                                       max(4, 2 * burst), 2))
+        snapshot_burst = burst;
+
+    /* The ring stores buffers as they come, single fields for alternate sources. */
+    if (prering_secs && 0 == prering_init(WIDTH, BUFFER_HEIGHT, prering_secs,
+                                          prering_mb << 20, 2))
+        prering_enabled = 1;
+}
 
-    if (!buffers)
-    {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
+static void *retire_pools(void *arg)
+{
+    (void)arg;
 
-    for (n_buffers = 0; n_buffers < 4; ++n_buffers)
-    {
-        buffers[n_buffers].length = buffer_size;
-        buffers[n_buffers].start = memalign( /* boundary */ page_size,
-                                            buffer_size);
+    snapshot_shutdown();
 
-        if (!buffers[n_buffers].start)
-        {
-            fprintf(stderr, "Out of memory\n");
-            exit(EXIT_FAILURE);
-        }
-    }
+    if (retire_ring)
+        prering_shutdown();
+
+    pthread_mutex_lock(&retire_lock);
+    retire_done = 1;
+    pthread_mutex_unlock(&retire_lock);
+
+    return NULL;
 }
 
-static void init_device(void)
+/*
+ * Stops handing frames to the pools and shuts them down, on the retire
+ * thread if background is set and it can be started.
+ */
+static void stop_pools(int background)
 {
-    struct v4l2_capability cap;
-    struct v4l2_cropcap cropcap;
-    struct v4l2_crop crop;
-    struct v4l2_format fmt;
-    unsigned int min;
+    snapshot_burst = 0;
+    snapshot_pending = 0;
 
-    if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap))
+    /* Still busy with an earlier pair, nothing was started since. */
+    if (retiring)
     {
-        if (EINVAL == errno)
-        {
-            fprintf(stderr, "%s is no V4L2 device\n", dev_name);
-            exit(EXIT_FAILURE);
-        }
-        else
-        {
-            errno_exit("VIDIOC_QUERYCAP");
-        }
-    }
+        if (background)
+            return;
 
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
-    {
-        fprintf(stderr, "%s is no video capture device\n", dev_name);
-        exit(EXIT_FAILURE);
+        pthread_join(retire_thread, NULL);
+        retiring = 0;
+        return;
     }
 
-    switch (io)
-    {
-    case IO_METHOD_READ:
-        if (!(cap.capabilities & V4L2_CAP_READWRITE))
-        {
-            fprintf(stderr, "%s does not support read i/o\n", dev_name);
-            exit(EXIT_FAILURE);
-        }
+    retire_ring = prering_enabled;
+    prering_enabled = 0;
 
-        break;
+    if (background)
+    {
+        retire_done = 0;
+        retiring = 0 == start_worker(&retire_thread, retire_pools, NULL);
+    }
 
-    case IO_METHOD_MMAP:
-    case IO_METHOD_USERPTR:
-        if (!(cap.capabilities & V4L2_CAP_STREAMING))
-        {
-            fprintf(stderr, "%s does not support streaming i/o\n", dev_name);
-            exit(EXIT_FAILURE);
-        }
+    if (!retiring)
+        retire_pools(NULL);
+}
 
-        break;
-    }
+/* Starts the pools for the current size once the old ones are gone. */
+static void check_pools(void)
+{
+    int done;
 
+    if (!retiring)
+        return;
 
-    /* Select video input, video standard and tune here. */
+    pthread_mutex_lock(&retire_lock);
+    done = retire_done;
+    pthread_mutex_unlock(&retire_lock);
 
+    if (!done)
+        return;
 
-    CLEAR(cropcap);
+    pthread_join(retire_thread, NULL);
+    retiring = 0;
+    start_pools();
+}
 
-    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+/*
+ * Sets up everything sized by the frame: the window, the RGB buffer, the
+ * field history and, unless the previous ones are still finishing, the
+ * snapshot and pre-event pools.
+ */
+static void init_frame_pipeline(void)
+{
+    int alternate = field_order == V4L2_FIELD_ALTERNATE;
 
-    if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap))
-    {
-        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        crop.c = cropcap.defrect;   /* reset to default */
+    buffer_sdl = (uint8_t*)malloc(WIDTH*HEIGHT*3);
 
-        if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop))
-        {
-            switch (errno)
-            {
-            case EINVAL:
-                /* Cropping not supported. */
-                break;
-            default:
-                /* Errors ignored. */
-                break;
-            }
-        }
-    }
-    else
+    if (!buffer_sdl
+        || (alternate && -1 == deinterlace_init(WIDTH, BUFFER_HEIGHT))
+        || (denoise_enabled && -1 == denoise_init(WIDTH, BUFFER_HEIGHT,
+                                                  alternate ? 2 : 1, denoise_threshold)))
     {
-        /* Errors ignored. */
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
     }
 
+    SDL_SetVideoMode(WIDTH, HEIGHT, 24, SDL_HWSURFACE);
 
-    CLEAR(fmt);
+    data_sf = SDL_CreateRGBSurfaceFrom(buffer_sdl, WIDTH, HEIGHT,
+                                       24, WIDTH * 3,
+                                       mask32(0), mask32(1), mask32(2), 0);
 
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width = WIDTH;
-    fmt.fmt.pix.height = HEIGHT;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-    fmt.fmt.pix.field = V4L2_FIELD_ALTERNATE; //V4L2_FIELD_INTERLACED;
+    if (!retiring)
+        start_pools();
+}
+
+/*
+ * Waits for queued snapshots and dumps, or with background set leaves
+ * them to retire_pools(), then frees what init_frame_pipeline() made.
+ */
+static void uninit_frame_pipeline(int background)
+{
+    stop_pools(background);
 
-    if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
-        errno_exit("VIDIOC_S_FMT");
+    deinterlace_free();
+    denoise_free();
 
-    /* Note VIDIOC_S_FMT may change width and height. */
+    SDL_FreeSurface(data_sf);
+    free(buffer_sdl);
+}
 
-    /* Buggy driver paranoia. */
-    min = fmt.fmt.pix.width * 2;
-    if (fmt.fmt.pix.bytesperline < min)
-        fmt.fmt.pix.bytesperline = min;
-    min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-    if (fmt.fmt.pix.sizeimage < min)
-        fmt.fmt.pix.sizeimage = min;
+/*
+ * Takes the frame size from the negotiated format. For
+ * V4L2_FIELD_ALTERNATE pix.height counts the lines of one field, the
+ * frames shown are twice as high.
+ */
+static void set_frame_size(const struct v4l2_pix_format *fmt)
+{
+    WIDTH = fmt->width;
+    BUFFER_HEIGHT = fmt->height;
+    field_order = fmt->field;
+    HEIGHT = field_order == V4L2_FIELD_ALTERNATE ? 2 * BUFFER_HEIGHT : BUFFER_HEIGHT;
+}
 
-    if (fmt.fmt.pix.width != WIDTH)
-        WIDTH = fmt.fmt.pix.width;
+/*
+ * The reverse of set_frame_size(): the buffer height to ask for to get
+ * frames of height lines in the field order requested.
+ */
+static size_t buffer_height_for(size_t height)
+{
+    return config.field == V4L2_FIELD_ALTERNATE ? height / 2 : height;
+}
 
-    if (fmt.fmt.pix.height != HEIGHT)
-        HEIGHT = fmt.fmt.pix.height;
+/* Opens and starts the device while the main thread sets up the display. */
+static void *open_device(void *arg)
+{
+    uint64_t t = now_ns();
 
-    switch (io)
-    {
-    case IO_METHOD_READ:
-        init_read(fmt.fmt.pix.sizeimage);
-        break;
+    (void)arg;
 
-    case IO_METHOD_MMAP:
-        init_mmap();
-        break;
+    cap = capture_open(&config);
+    startup.device = now_ns() - t;
 
-    case IO_METHOD_USERPTR:
-        init_userp(fmt.fmt.pix.sizeimage);
-        break;
+    t = now_ns();
+    if (cap && -1 == capture_start(cap))
+    {
+        capture_close(cap);
+        cap = NULL;
     }
-}
-
-static void close_device(void)
-{
-    if (-1 == close(fd))
-        errno_exit("close");
+    startup.stream_on = now_ns() - t;
 
-    fd = -1;
+    return NULL;
 }
 
-static void open_device(void)
+/*
+ * Switches size and I/O method without closing the device or the window.
+ * width and height are the frame size to show, alternate sources are
+ * asked for fields of half the height. The frame sized parts are rebuilt
+ * only if the negotiated format changed; the old snapshot and pre-event
+ * pools finish their queued work in the background, frames in the ring
+ * that no dump asked for are dropped.
+ */
+static void reconfigure(size_t width, size_t height, capture_io io)
 {
-    struct stat st;
+    const struct v4l2_pix_format *fmt;
+    struct capture_config previous = config;
 
-    if (-1 == stat(dev_name, &st))
-    {
-        fprintf(stderr, "Cannot identify '%s': %d, %s\n",
-                dev_name, errno, strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+    reconfigure_started = now_ns();
 
-    if (!S_ISCHR(st.st_mode))
+    config.width = width;
+    config.height = buffer_height_for(height);
+    config.io = io;
+
+    /* Keep showing the old setup if the new one is refused. */
+    if (-1 == capture_reconfigure(cap, &config))
     {
-        fprintf(stderr, "%s is no device\n", dev_name);
-        exit(EXIT_FAILURE);
-    }
+        fprintf(stderr, "Cannot reconfigure, keeping the previous setup\n");
 
-    fd = open(dev_name, O_RDWR /* required */  | O_NONBLOCK, 0);
+        /* A failed reconfigure leaves the device stopped. */
+        config = previous;
+        reconfigure_started = 0;
 
-    if (-1 == fd)
-    {
-        fprintf(stderr, "Cannot open '%s': %d, %s\n",
-                dev_name, errno, strerror(errno));
-        exit(EXIT_FAILURE);
+        if (-1 == capture_reconfigure(cap, &config) || -1 == capture_start(cap))
+            exit(EXIT_FAILURE);
     }
-}
-
-static void usage(FILE * fp, int argc, char **argv)
-{
-    fprintf(fp,
-            "Usage: %s [options]\n\n"
-            "Options:\n"
-            "-d | --device name   Video device name [/dev/video]\n"
-            "-h | --help          Print this message\n"
-            "-m | --mmap          Use memory mapped buffers\n"
-            "-r | --read          Use read() calls\n"
-            "-u | --userp         Use application allocated buffers\n"
-            "-x | --width         Video width\n"
-            "-y | --height        Video height\n"
-             "", argv[0]);
-}
 
-static const char short_options[] = "d:hmrux:y:";
+    /* STREAMOFF to STREAMON, buffers included. */
+    reconfigure_stream = now_ns() - reconfigure_started;
 
-static const struct option long_options[] = {
-    {"device", required_argument, NULL, 'd'},
-    {"help", no_argument, NULL, 'h'},
-    {"mmap", no_argument, NULL, 'm'},
-    {"read", no_argument, NULL, 'r'},
-    {"userp", no_argument, NULL, 'u'},
-    {"width", required_argument, NULL, 'x'},
-    {"height", required_argument, NULL, 'y'},
-    {0, 0, 0, 0}
-};
+    fmt = capture_format(cap);
 
-static int sdl_filter(const SDL_Event * event)
-{
-    return event->type == SDL_QUIT;
+    if (fmt->width != WIDTH || fmt->height != BUFFER_HEIGHT
+        || fmt->field != field_order)
+    {
+        uninit_frame_pipeline(1);
+        set_frame_size(fmt);
+        init_frame_pipeline();
+    }
 }
 
-#define mask32(BYTE) (*(uint32_t *)(uint8_t [4]){ [BYTE] = 0xff })
-
 int main(int argc, char **argv)
 {
-    dev_name = "/dev/video0";
+    int perf = 0;
+    pthread_t device_thread;
+    int device_threaded;
+    uint64_t t;
+
+    startup.start = now_ns();
 
     for (;;)
     {
@@ -836,7 +1072,7 @@ int main(int argc, char **argv)
             break;
 
         case 'd':
-            dev_name = optarg;
+            config.dev_name = optarg;
             break;
 
         case 'h':
@@ -844,15 +1080,15 @@ int main(int argc, char **argv)
             exit(EXIT_SUCCESS);
 
         case 'm':
-            io = IO_METHOD_MMAP;
+            config.io = CAPTURE_IO_MMAP;
             break;
 
         case 'r':
-            io = IO_METHOD_READ;
+            config.io = CAPTURE_IO_READ;
             break;
 
         case 'u':
-            io = IO_METHOD_USERPTR;
+            config.io = CAPTURE_IO_USERPTR;
             break;
 
         case 'x':
@@ -863,42 +1099,165 @@ int main(int argc, char **argv)
             HEIGHT = atoi(optarg);
             break;
 
+        case 'p':
+            perf = 1;
+            break;
+
+        case 's':
+            if (-1 == snapshot_parse_format(optarg, &snapshot_fmt))
+            {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            snapshot = 1;
+            break;
+
+        case 'n':
+            burst = max(1, atoi(optarg));
+            break;
+
+        case 'e':
+            prering_secs = max(0, atoi(optarg));
+            break;
+
+        case 'M':
+            prering_mb = max(1, atoi(optarg));
+            break;
+
+        case 'i':
+            if (-1 == deinterlace_parse_mode(optarg, &deinterlace))
+            {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'S':
+            stats_enabled = 1;
+            break;
+
+        case 'D':
+            denoise_enabled = 1;
+            denoise_threshold = max(0, atoi(optarg));
+            break;
+
+        case 'c':
+            if (4 != sscanf(optarg, "%zux%zu+%zu+%zu", &crop.width,
+                            &crop.height, &crop.x, &crop.y) || !crop.width)
+            {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 't':
+            if (3 != sscanf(optarg, "%2hhx%2hhx%2hhx", &track_rgb[0],
+                            &track_rgb[1], &track_rgb[2]))
+            {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            track_enabled = 1;
+            break;
+
+        case 'B':
+            budget_ms = atof(optarg);
+            if (budget_ms < 0)
+                budget_ms = 0;
+            break;
+
         default:
             usage(stderr, argc, argv);
             exit(EXIT_FAILURE);
         }
     }
 
-    generate_YCbCr_to_RGB_lookup();
+    /*
+     * The table is only needed for the first conversion, the device only
+     * once the window size is known; both run behind SDL startup.
+     */
+    startup.lut = now_ns();
+    lut_start();
+
+    config.width = WIDTH;
+    config.height = buffer_height_for(HEIGHT);
+
+    device_threaded = 0 == pthread_create(&device_thread, NULL, open_device, NULL);
+    if (!device_threaded)
+        open_device(NULL);
 
-    open_device();
-    init_device();
+    t = now_ns();
 
     atexit(SDL_Quit);
     if (SDL_Init(SDL_INIT_VIDEO) < 0)
+    {
+        fprintf(stderr, "Cannot initialize SDL: %s\n", SDL_GetError());
+
+        /* The device is still being opened, let it finish and shut it down. */
+        if (device_threaded)
+            pthread_join(device_thread, NULL);
+
+        if (cap)
+        {
+            capture_stop(cap);
+            capture_close(cap);
+        }
+
         return 1;
+    }
 
     SDL_WM_SetCaption("SDL Video viewer", NULL);
 
-    buffer_sdl = (uint8_t*)malloc(WIDTH*HEIGHT*3);
+    startup.display = now_ns() - t;
 
-    SDL_SetVideoMode(WIDTH, HEIGHT, 24, SDL_HWSURFACE);
+    if (device_threaded)
+        pthread_join(device_thread, NULL);
 
-    data_sf = SDL_CreateRGBSurfaceFrom(buffer_sdl, WIDTH, HEIGHT,
-                                       24, WIDTH * 3,
-                                       mask32(0), mask32(1), mask32(2), 0);
+    if (!cap)
+        exit(EXIT_FAILURE);
+
+    /* Note the driver may change width and height. */
+    set_frame_size(capture_format(cap));
+
+    t = now_ns();
+    init_frame_pipeline();
+    startup.display += now_ns() - t;
+
+    init_filter_chain();
 
     SDL_SetEventFilter(sdl_filter);
 
-    start_capturing();
+    /* Left at their default otherwise, so a stray signal is not silently lost. */
+    if (snapshot)
+        signal(SIGUSR1, snapshot_signal);
+    if (prering_secs)
+        signal(SIGUSR2, prering_signal);
+
+    if (perf && -1 == perf_open())
+        fprintf(stderr, "Hardware counters unavailable, --perf ignored\n");
+
     mainloop();
-    stop_capturing();
 
-    uninit_device();
-    close_device();
+    capture_stop(cap);
 
-    SDL_FreeSurface(data_sf);
-    free(buffer_sdl);
+    perf_report(stdout);
+    perf_close();
+
+    filterchain_report(stdout);
+    filterchain_clear();
+
+    uninit_frame_pipeline(0);
+
+    if (snapshot_dropped())
+        fprintf(stderr, "%lu snapshot frames dropped\n", snapshot_dropped());
+
+    if (prering_dropped())
+        fprintf(stderr, "%lu frames skipped by the pre-event ring\n",
+                prering_dropped());
+
+    capture_close(cap);
+
+    framestats_free();
 
     exit(EXIT_SUCCESS);
 
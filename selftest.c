@@ -0,0 +1,1025 @@
+/*
+ * Self test of the conversion, deinterlacing and denoise kernels.
+ *
+ * Runs without a camera or a display, see usage() or ./build.sh test.
+ * Exits non-zero if any check failed.
+ *
+ * References are worked out from what the kernels are documented to
+ * compute, not from their code:
+ *
+ * - Colour conversion is YCbCrToRGB(), the definition the lookup table is
+ *   generated from. Where a kernel interpolates, the matrix is applied in
+ *   double precision to the unrounded interpolation.
+ * - Deinterlacing works in frame coordinates. A missing line is the mean
+ *   of the lines above and below it, or the only one of them at the top
+ *   and bottom of the frame; weave takes it from the previous field.
+ *   Adaptive must weave where the previous field is within
+ *   DEINTERLACE_MOTION_THRESHOLD - 1 of that mean and bob where it is
+ *   further off than DEINTERLACE_MOTION_THRESHOLD + 1. In between either
+ *   is accepted, so the check does not depend on how the kernel rounds.
+ * - Denoise is h' = (3h + c) / 4 rounded to nearest where the frame is
+ *   within the threshold of the history and h' = c elsewhere, with one
+ *   history per field parity.
+ *
+ * Input lines are padded, so every kernel also sees a stride that is not
+ * width * 2. Besides still frames there is a block moving over a noisy
+ * gradient and a gradient whose brightness steps up every frame.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "convert.h"
+#include "deinterlace.h"
+#include "denoise.h"
+#include "framestats.h"
+#include "util.h"
+
+#define max(a, b) (a > b ? a : b)
+#define min(a, b) (a > b ? b : a)
+
+/* A kernel may get this much slower than the baseline before the test fails. */
+#define SELFTEST_SLOWDOWN 1.25
+
+/*
+ * Truncating kernels against an unrounded reference: half a level from
+ * the interpolation, amplified up to 1.77 by the colour matrix, plus up
+ * to one level of truncation.
+ */
+#define INTERPOLATED_MAX_ERROR 3
+#define INTERPOLATED_MEAN_ERROR 1.0
+
+/* Frames in the moving and changing sequences. */
+#define SEQUENCE_FRAMES 8
+
+/* Bytes of padding after every input line. */
+#define LINE_PADDING 40
+
+#define MAX_RESULTS 16
+
+enum
+{
+    REF_SKIP,                   /* either answer is right */
+    REF_EXACT,                  /* looked up, must match */
+    REF_INTERPOLATED,           /* may be off by the rounding */
+};
+
+static size_t width = 640;
+static size_t height = 480;
+static size_t line_bytes;
+static size_t stride;
+
+static unsigned int failures = 0;
+
+static struct
+{
+    char name[32];
+    double ns_per_pixel;
+} results[MAX_RESULTS];
+static int n_results = 0;
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (!p)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return p;
+}
+
+/* Copies packed frame lines first, first + step, ... into padded lines. */
+static void pad_lines(uint8_t * out, const uint8_t * frame, size_t first,
+                      size_t step)
+{
+    size_t y;
+
+    for (y = 0; first + y * step < height; y++)
+    {
+        memcpy(out + y * stride, frame + (first + y * step) * line_bytes, line_bytes);
+        memset(out + y * stride + line_bytes, 0xa5, stride - line_bytes);
+    }
+}
+
+static void convert_rows(uint8_t * rgb, const uint8_t * yuyv, size_t lines,
+                         deinterlace_row_fn convert)
+{
+    size_t y;
+
+    for (y = 0; y < lines; y++)
+        convert(rgb + y * width * 3, yuyv + y * stride, width);
+}
+
+static void reference_pixel(float *rgb, double y, double cb, double cr)
+{
+    double R = y + 1.40200 * (cr - 0x80);
+    double G = y - 0.34414 * (cb - 0x80) - 0.71414 * (cr - 0x80);
+    double B = y + 1.77200 * (cb - 0x80);
+
+    rgb[0] = max(0.0, min(255.0, R));
+    rgb[1] = max(0.0, min(255.0, G));
+    rgb[2] = max(0.0, min(255.0, B));
+}
+
+/*
+ * RGB reference of a frame given as YUYV values, which may be fractional
+ * or NAN for bytes where any answer is accepted.
+ */
+static void reference_frame(float *rgb, uint8_t * kind, const double *v)
+{
+    size_t i;
+
+    for (i = 0; i < width * height; i++)
+    {
+        const double *pair = v + (i & ~(size_t)1) * 2;
+        double y = v[i * 2];
+        double cb = pair[1];
+        double cr = pair[3];
+
+        if (isnan(y) || isnan(cb) || isnan(cr))
+        {
+            kind[i] = REF_SKIP;
+        }
+        else if (y == floor(y) && cb == floor(cb) && cr == floor(cr))
+        {
+            uint8_t r;
+            uint8_t g;
+            uint8_t b;
+
+            YCbCrToRGB(y, cb, cr, &r, &g, &b);
+            rgb[i * 3] = r;
+            rgb[i * 3 + 1] = g;
+            rgb[i * 3 + 2] = b;
+            kind[i] = REF_EXACT;
+        }
+        else
+        {
+            reference_pixel(rgb + i * 3, y, cb, cr);
+            kind[i] = REF_INTERPOLATED;
+        }
+    }
+}
+
+static void check_rgb(const char *kernel, const char *frame, const uint8_t * rgb,
+                      const float *ref, const uint8_t * kind)
+{
+    double exact_worst = 0;
+    double worst = 0;
+    double sum = 0;
+    size_t n = 0;
+    size_t i;
+    int failed;
+    int c;
+
+    for (i = 0; i < width * height; i++)
+    {
+        for (c = 0; c < 3; c++)
+        {
+            double e = fabs(rgb[i * 3 + c] - ref[i * 3 + c]);
+
+            if (kind[i] == REF_EXACT)
+            {
+                exact_worst = max(exact_worst, e);
+            }
+            else if (kind[i] == REF_INTERPOLATED)
+            {
+                worst = max(worst, e);
+                sum += e;
+                n++;
+            }
+        }
+    }
+
+    failed = exact_worst > 0 || worst > INTERPOLATED_MAX_ERROR
+             || (n && sum / n > INTERPOLATED_MEAN_ERROR);
+    failures += failed;
+
+    printf("%-4s %-24s %-12s exact max %3.0f, interpolated max %3.0f mean %.3f\n",
+           failed ? "FAIL" : "ok", kernel, frame, ceil(exact_worst), ceil(worst),
+           n ? sum / n : 0.0);
+}
+
+/* Checks what YUV422_row_to_RGB_stats() gathered against sums taken here. */
+static void check_stats(const char *frame, const struct frame_stats *st,
+                        const uint8_t * rgb, const uint8_t * yuyv)
+{
+    uint32_t histogram[FRAMESTATS_CHANNELS][256];
+    int64_t lap_sum = 0;
+    uint64_t lap_sq = 0;
+    uint64_t lap_n = 0;
+    double focus = 0;
+    int failed = 0;
+    size_t x;
+    size_t y;
+    size_t i;
+    int c;
+
+    memset(histogram, 0, sizeof(histogram));
+
+    for (i = 0; i < width * height; i++)
+    {
+        histogram[FRAMESTATS_Y][yuyv[i * 2]]++;
+        for (c = 0; c < 3; c++)
+            histogram[FRAMESTATS_R + c][rgb[i * 3 + c]]++;
+    }
+
+    /* Variance of the 4-neighbour luma Laplacian over the inner pixels. */
+    for (y = 1; y + 1 < height; y++)
+    {
+        for (x = 1; x + 1 < width; x++)
+        {
+            const uint8_t *m = yuyv + y * line_bytes + x * 2;
+            int l = 4 * m[0] - m[-2] - m[2] - m[-(long)line_bytes] - m[line_bytes];
+
+            lap_sum += l;
+            lap_sq += (uint64_t)(l * l);
+            lap_n++;
+        }
+    }
+
+    if (lap_n)
+        focus = (double)lap_sq / lap_n - ((double)lap_sum / lap_n) * ((double)lap_sum / lap_n);
+
+    if (memcmp(histogram[FRAMESTATS_Y], st->histogram, sizeof(histogram[0]))
+        || fabs(st->focus - focus) > 1e-9 * max(1.0, focus)
+        || st->pixels != width * height)
+        failed = 1;
+
+    for (c = 0; c < FRAMESTATS_CHANNELS; c++)
+    {
+        uint64_t sum = 0;
+        int lo = -1;
+        int hi = 0;
+
+        for (i = 0; i < 256; i++)
+        {
+            sum += (uint64_t)i * histogram[c][i];
+            if (histogram[c][i])
+            {
+                if (lo < 0)
+                    lo = i;
+                hi = i;
+            }
+        }
+
+        if (st->min[c] != lo || st->max[c] != hi
+            || fabs(st->mean[c] - (double)sum / (width * height)) > 1e-9
+            || st->clipped_low[c] != histogram[c][0]
+            || st->clipped_high[c] != histogram[c][255])
+            failed = 1;
+    }
+
+    failures += failed;
+
+    printf("%-4s %-24s %-12s focus %.3f\n", failed ? "FAIL" : "ok", "stats",
+           frame, st->focus);
+}
+
+/* Every entry of the lookup table against YCbCrToRGB(). */
+static void test_lookup(void)
+{
+    unsigned long bad = 0;
+    int y;
+    int cb;
+    int cr;
+
+    for (y = 0; y < 256; y++)
+    {
+        for (cb = 0; cb < 256; cb++)
+        {
+            for (cr = 0; cr < 256; cr++)
+            {
+                uint8_t r;
+                uint8_t g;
+                uint8_t b;
+
+                YCbCrToRGB(y, cb, cr, &r, &g, &b);
+                bad += YCbCr_to_RGB[y][cb][cr] != (uint32_t)(r << 16 | g << 8 | b);
+            }
+        }
+    }
+
+    failures += bad != 0;
+
+    printf("%-4s %-24s %-12s %lu of %u entries differ\n", bad ? "FAIL" : "ok",
+           "lookup table", "all", bad, 1u << 24);
+}
+
+/*
+ * denoise_line() on a history and a frame that differ, within and beyond
+ * the threshold. Odd lengths run the scalar tail after the SSE2 part.
+ */
+static void test_denoise_line(void)
+{
+    static const size_t lengths[] = { 1, 15, 16, 17, 64, 1283 };
+    uint8_t h[1283];
+    uint8_t cur[1283];
+    uint8_t want[1283];
+    unsigned long bad = 0;
+    unsigned int pass;
+    size_t l;
+    size_t i;
+
+    srand(2);
+
+    for (pass = 0; pass < 64; pass++)
+    {
+        for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+        {
+            for (i = 0; i < lengths[l]; i++)
+            {
+                int d = rand() % (2 * DENOISE_DEFAULT_THRESHOLD + 3) -
+                        (DENOISE_DEFAULT_THRESHOLD + 1);
+
+                h[i] = rand() & 0xff;
+                cur[i] = pass & 1 ? rand() & 0xff : max(0, min(255, h[i] + d));
+
+                if (abs(cur[i] - h[i]) <= DENOISE_DEFAULT_THRESHOLD)
+                    want[i] = floor((3.0 * h[i] + cur[i]) / 4.0 + 0.5);
+                else
+                    want[i] = cur[i];
+            }
+
+            denoise_line(h, cur, lengths[l], DENOISE_DEFAULT_THRESHOLD);
+
+            for (i = 0; i < lengths[l]; i++)
+                bad += h[i] != want[i];
+        }
+    }
+
+    failures += bad != 0;
+
+    printf("%-4s %-24s %-12s %lu bytes differ\n", bad ? "FAIL" : "ok",
+           "denoise line", "changing", bad);
+}
+
+/* Conversion with and without statistics of one frame. */
+static void test_convert(const char *name, const uint8_t * frame)
+{
+    uint8_t *yuyv = xmalloc(stride * height);
+    uint8_t *rgb = xmalloc(width * height * 3);
+    float *ref = xmalloc(width * height * 3 * sizeof(*ref));
+    uint8_t *kind = xmalloc(width * height);
+    double *v = xmalloc(line_bytes * height * sizeof(*v));
+    struct frame_stats st;
+    size_t i;
+
+    for (i = 0; i < line_bytes * height; i++)
+        v[i] = frame[i];
+    reference_frame(ref, kind, v);
+
+    pad_lines(yuyv, frame, 0, 1);
+
+    convert_rows(rgb, yuyv, height, YUV422_row_to_RGB);
+    check_rgb("convert", name, rgb, ref, kind);
+
+    memset(rgb, 0, width * height * 3);
+    if (0 == framestats_begin(width))
+    {
+        convert_rows(rgb, yuyv, height, YUV422_row_to_RGB_stats);
+        framestats_end(&st);
+        check_rgb("convert+stats", name, rgb, ref, kind);
+        check_stats(name, &st, rgb, frame);
+    }
+
+    free(v);
+    free(kind);
+    free(ref);
+    free(rgb);
+    free(yuyv);
+}
+
+/* Missing line y of frame, from its neighbours in the same field. */
+static double bob_value(const uint8_t * frame, size_t y, size_t j)
+{
+    if (y == 0)
+        return frame[line_bytes + j];
+
+    if (y + 1 == height)
+        return frame[(y - 1) * line_bytes + j];
+
+    return (frame[(y - 1) * line_bytes + j] + frame[(y + 1) * line_bytes + j]) / 2.0;
+}
+
+/* What the field of parity bottom of cur should become, after a field of prev. */
+static void reference_deinterlace(double *v, const uint8_t * cur,
+                                  const uint8_t * prev, int bottom,
+                                  deinterlace_mode mode)
+{
+    size_t y;
+    size_t j;
+
+    for (y = 0; y < height; y++)
+    {
+        for (j = 0; j < line_bytes; j++)
+        {
+            size_t i = y * line_bytes + j;
+            double s;
+            double d;
+
+            if ((int)(y & 1) == bottom)
+            {
+                v[i] = cur[i];
+                continue;
+            }
+
+            s = bob_value(cur, y, j);
+
+            if (!prev || mode == DEINTERLACE_BOB)
+            {
+                v[i] = s;
+                continue;
+            }
+
+            if (mode == DEINTERLACE_WEAVE)
+            {
+                v[i] = prev[i];
+                continue;
+            }
+
+            d = fabs(prev[i] - s);
+            if (d <= DEINTERLACE_MOTION_THRESHOLD - 1)
+                v[i] = prev[i];
+            else if (d > DEINTERLACE_MOTION_THRESHOLD + 1)
+                v[i] = s;
+            else
+                v[i] = NAN;
+        }
+    }
+}
+
+/*
+ * Deinterlaces alternating fields of the first three frames, top field
+ * first, and checks every output. The first field has nothing to weave
+ * with and must come out bobbed, so must a fourth top field of the last
+ * frame, as after a dropped bottom field.
+ */
+static void test_deinterlace(const char *name, uint8_t ** frames)
+{
+    uint8_t *field = xmalloc(stride * (height / 2));
+    uint8_t *rgb = xmalloc(width * height * 3);
+    float *ref = xmalloc(width * height * 3 * sizeof(*ref));
+    uint8_t *kind = xmalloc(width * height);
+    double *v = xmalloc(line_bytes * height * sizeof(*v));
+    int m;
+    int t;
+
+    for (m = 0; m < DEINTERLACE_COUNT; m++)
+    {
+        char kernel[32];
+        char frame[32];
+
+        if (-1 == deinterlace_init(width, height / 2))
+            break;
+
+        snprintf(kernel, sizeof(kernel), "deinterlace %s", deinterlace_mode_name(m));
+
+        for (t = 0; t < 4; t++)
+        {
+            int bottom = t == 1;
+            const uint8_t *cur = frames[t < 3 ? t : 2];
+            const uint8_t *prev = t && t < 3 ? frames[t - 1] : NULL;
+
+            pad_lines(field, cur, bottom, 2);
+            deinterlace_field(rgb, field, stride, bottom, m, YUV422_row_to_RGB);
+
+            reference_deinterlace(v, cur, prev, bottom, m);
+            reference_frame(ref, kind, v);
+
+            snprintf(frame, sizeof(frame), "%s %d", name, t);
+            check_rgb(kernel, frame, rgb, ref, kind);
+        }
+
+        deinterlace_free();
+    }
+
+    free(v);
+    free(kind);
+    free(ref);
+    free(rgb);
+    free(field);
+}
+
+/*
+ * Runs the denoiser over n frames, once with a single history and once
+ * with frames alternating between two field histories.
+ */
+static void test_denoise(const char *name, uint8_t ** frames, unsigned int n)
+{
+    uint8_t *yuyv = xmalloc(stride * height);
+    uint8_t *want[2];
+    int fields;
+
+    want[0] = xmalloc(line_bytes * height);
+    want[1] = xmalloc(line_bytes * height);
+
+    for (fields = 1; fields <= 2; fields++)
+    {
+        unsigned long bad = 0;
+        unsigned int t;
+        size_t i;
+
+        if (-1 == denoise_init(width, height, fields, DENOISE_DEFAULT_THRESHOLD))
+            break;
+
+        for (t = 0; t < n; t++)
+        {
+            const uint8_t *c = frames[t];
+            int f = fields == 2 ? (int)(t & 1) : 0;
+            uint8_t *h = want[f];
+            const uint8_t *out;
+
+            for (i = 0; i < line_bytes * height; i++)
+            {
+                if (t < (unsigned int)fields || abs(c[i] - h[i]) > DENOISE_DEFAULT_THRESHOLD)
+                    h[i] = c[i];
+                else
+                    h[i] = floor((3.0 * h[i] + c[i]) / 4.0 + 0.5);
+            }
+
+            pad_lines(yuyv, c, 0, 1);
+            out = denoise_frame(yuyv, stride, f);
+
+            for (i = 0; i < line_bytes * height; i++)
+                bad += out[i] != h[i];
+        }
+
+        denoise_free();
+
+        failures += bad != 0;
+
+        printf("%-4s %-24s %-12s %lu bytes differ\n", bad ? "FAIL" : "ok",
+               fields == 2 ? "denoise fields" : "denoise", name, bad);
+    }
+
+    free(want[1]);
+    free(want[0]);
+    free(yuyv);
+}
+
+/* Checks a still frame: one conversion and the same frame over and over. */
+static void test_still(const char *name, uint8_t * frame)
+{
+    uint8_t *frames[3] = { frame, frame, frame };
+
+    test_convert(name, frame);
+    test_denoise(name, frames, 3);
+
+    if (!(height & 1))
+        test_deinterlace(name, frames);
+}
+
+static void test_sequence(const char *name, uint8_t ** frames, unsigned int n)
+{
+    test_denoise(name, frames, n);
+
+    if (!(height & 1) && n >= 3)
+        test_deinterlace(name, frames);
+}
+
+static void make_gradient(uint8_t * frame)
+{
+    size_t i;
+
+    for (i = 0; i < line_bytes * height; i += 4)
+    {
+        size_t x = (i / 2) % width;
+        size_t y = (i / 2) / width;
+
+        frame[i] = (x + y) & 0xff;
+        frame[i + 1] = (x / 4) & 0xff;
+        frame[i + 2] = (x + y + 1) & 0xff;
+        frame[i + 3] = (y / 2) & 0xff;
+    }
+}
+
+/* A saturated block moving down and to the right over a noisy gradient. */
+static void make_moving(uint8_t * frame, unsigned int t)
+{
+    static const uint8_t block[4] = { 235, 60, 235, 200 };
+    size_t x0 = 16 + 24 * t;
+    size_t y0 = 8 + 6 * t;
+    size_t x;
+    size_t y;
+    size_t i;
+
+    make_gradient(frame);
+
+    for (i = 0; i < line_bytes * height; i++)
+        frame[i] = max(0, min(255, frame[i] + rand() % 5 - 2));
+
+    for (y = y0; y < min(y0 + 32, height); y++)
+        for (x = x0; x < min(x0 + 64, width); x++)
+            frame[y * line_bytes + x * 2] = block[(x & 1) * 2];
+
+    for (y = y0; y < min(y0 + 32, height); y++)
+    {
+        for (x = x0 & ~(size_t)1; x + 1 < min(x0 + 64, width); x += 2)
+        {
+            frame[y * line_bytes + x * 2 + 1] = block[1];
+            frame[y * line_bytes + x * 2 + 3] = block[3];
+        }
+    }
+}
+
+/* The gradient with luma brightening by 40 every frame, as if a light came on. */
+static void make_changing(uint8_t * frame, unsigned int t)
+{
+    size_t i;
+
+    make_gradient(frame);
+
+    for (i = 0; i < line_bytes * height; i += 2)
+        frame[i] = min(255, frame[i] + 40 * t);
+}
+
+static const uint8_t *bench_input;
+static uint8_t *bench_rgb;
+static deinterlace_mode bench_mode;
+static int bench_bottom;
+
+static void bench_convert(void)
+{
+    convert_rows(bench_rgb, bench_input, height, YUV422_row_to_RGB);
+}
+
+static void bench_convert_stats(void)
+{
+    struct frame_stats st;
+
+    framestats_begin(width);
+    convert_rows(bench_rgb, bench_input, height, YUV422_row_to_RGB_stats);
+    framestats_end(&st);
+}
+
+static void bench_denoise(void)
+{
+    denoise_frame(bench_input, stride, 0);
+}
+
+static void bench_deinterlace(void)
+{
+    bench_bottom = !bench_bottom;
+    deinterlace_field(bench_rgb, bench_input, stride, bench_bottom, bench_mode,
+                      YUV422_row_to_RGB);
+}
+
+static void bench_run(const char *name, void (*fn) (void), unsigned int frames)
+{
+    uint64_t t;
+    unsigned int i;
+
+    fn();                       /* warm up caches and the LUT */
+
+    t = now_ns();
+    for (i = 0; i < frames; i++)
+        fn();
+    t = now_ns() - t;
+
+    if (n_results < MAX_RESULTS)
+    {
+        snprintf(results[n_results].name, sizeof(results[0].name), "%s", name);
+        results[n_results].ns_per_pixel = (double)t / frames / (width * height);
+        n_results++;
+    }
+}
+
+/* Times every kernel on a moving frame, ns per output pixel. */
+static void bench(unsigned int frames)
+{
+    uint8_t *frame = xmalloc(line_bytes * height);
+    uint8_t *yuyv = xmalloc(stride * height);
+    char name[32];
+    int m;
+
+    make_moving(frame, 0);
+    pad_lines(yuyv, frame, 0, 1);
+
+    bench_input = yuyv;
+    bench_rgb = xmalloc(width * height * 3);
+
+    bench_run("convert", bench_convert, frames);
+    bench_run("convert+stats", bench_convert_stats, frames);
+
+    if (0 == denoise_init(width, height, 1, DENOISE_DEFAULT_THRESHOLD))
+    {
+        bench_run("denoise", bench_denoise, frames);
+        denoise_free();
+    }
+
+    for (m = 0; m < DEINTERLACE_COUNT && !(height & 1); m++)
+    {
+        if (-1 == deinterlace_init(width, height / 2))
+            break;
+
+        bench_mode = m;
+        snprintf(name, sizeof(name), "deinterlace %s", deinterlace_mode_name(m));
+        bench_run(name, bench_deinterlace, frames);
+        deinterlace_free();
+    }
+
+    free(bench_rgb);
+    free(yuyv);
+    free(frame);
+}
+
+static void write_baseline(const char *baseline)
+{
+    FILE *fp = fopen(baseline, "w");
+    int i;
+
+    if (!fp)
+    {
+        fprintf(stderr, "Cannot write '%s': %d, %s\n", baseline, errno,
+                strerror(errno));
+        failures++;
+        return;
+    }
+
+    for (i = 0; i < n_results; i++)
+    {
+        fprintf(fp, "%s\t%.3f\n", results[i].name, results[i].ns_per_pixel);
+        printf("time %-24s %8.2f ns/pixel\n", results[i].name, results[i].ns_per_pixel);
+    }
+
+    fclose(fp);
+    printf("Baseline written to %s\n", baseline);
+}
+
+/*
+ * Holds the timings against baseline, one "name<TAB>ns/pixel" line per
+ * kernel. A missing file or a kernel missing from it is a failure.
+ */
+static void check_baseline(const char *baseline)
+{
+    FILE *fp = fopen(baseline, "r");
+    int seen[MAX_RESULTS] = { 0 };
+    char line[64];
+    int i;
+
+    if (!fp)
+    {
+        printf("FAIL %-24s cannot open '%s': %s, create it with --write-baseline\n",
+               "speed", baseline, strerror(errno));
+        failures++;
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        char *tab = strchr(line, '\t');
+        double base;
+
+        if (!tab)
+            continue;
+
+        *tab = '\0';
+        base = atof(tab + 1);
+
+        for (i = 0; i < n_results; i++)
+        {
+            double now = results[i].ns_per_pixel;
+            int failed;
+
+            if (strcmp(line, results[i].name))
+                continue;
+
+            seen[i] = 1;
+            failed = now > base * SELFTEST_SLOWDOWN;
+            failures += failed;
+
+            printf("%-4s %-24s %8.2f ns/pixel, baseline %.2f\n",
+                   failed ? "FAIL" : "ok", line, now, base);
+        }
+    }
+
+    fclose(fp);
+
+    for (i = 0; i < n_results; i++)
+    {
+        if (!seen[i])
+        {
+            printf("FAIL %-24s %8.2f ns/pixel, not in '%s'\n", results[i].name,
+                   results[i].ns_per_pixel, baseline);
+            failures++;
+        }
+    }
+}
+
+/* Consecutive raw YUYV frames of the -x/-y size from file. */
+static void test_recorded(const char *recorded)
+{
+    uint8_t *frames[SEQUENCE_FRAMES];
+    uint8_t *frame;
+    FILE *fp = fopen(recorded, "rb");
+    char name[16];
+    unsigned int n = 0;
+    unsigned int total = 0;
+    unsigned int i;
+
+    if (!fp)
+    {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n", recorded, errno,
+                strerror(errno));
+        failures++;
+        return;
+    }
+
+    frame = xmalloc(line_bytes * height);
+    for (i = 0; i < SEQUENCE_FRAMES; i++)
+        frames[i] = xmalloc(line_bytes * height);
+
+    /* Every frame on its own, the first few also as a sequence. */
+    while (fread(frame, line_bytes * height, 1, fp) == 1)
+    {
+        snprintf(name, sizeof(name), "recorded %u", total++);
+        test_convert(name, frame);
+
+        if (n < SEQUENCE_FRAMES)
+            memcpy(frames[n++], frame, line_bytes * height);
+    }
+
+    fclose(fp);
+
+    if (!total)
+    {
+        fprintf(stderr, "No %zux%zu frame in '%s'\n", width, height, recorded);
+        failures++;
+    }
+    else
+    {
+        test_sequence("recorded", frames, n);
+    }
+
+    for (i = 0; i < SEQUENCE_FRAMES; i++)
+        free(frames[i]);
+    free(frame);
+}
+
+static void usage(FILE * fp, char **argv)
+{
+    fprintf(fp,
+            "Usage: %s [options]\n\n"
+            "Checks the conversion, deinterlacing and denoise kernels against\n"
+            "reference implementations and exits non-zero on failure.\n\n"
+            "Options:\n"
+            "-h | --help               Print this message\n"
+            "-x | --width              Frame width [640]\n"
+            "-y | --height             Frame height [480]\n"
+            "-R | --recorded file      Also check raw YUYV frames of that size\n"
+            "-P | --baseline file      Fail if a kernel got %d%% slower than in file\n"
+            "-W | --write-baseline file Write the timings of this run to file\n"
+            "-f | --frames n           Frames timed per kernel [50]\n"
+            "", argv[0], (int)((SELFTEST_SLOWDOWN - 1) * 100 + 0.5));
+}
+
+static const char short_options[] = "hx:y:R:P:W:f:";
+
+static const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"width", required_argument, NULL, 'x'},
+    {"height", required_argument, NULL, 'y'},
+    {"recorded", required_argument, NULL, 'R'},
+    {"baseline", required_argument, NULL, 'P'},
+    {"write-baseline", required_argument, NULL, 'W'},
+    {"frames", required_argument, NULL, 'f'},
+    {0, 0, 0, 0}
+};
+
+int main(int argc, char **argv)
+{
+    const char *recorded = NULL;
+    const char *baseline = NULL;
+    const char *new_baseline = NULL;
+    unsigned int frames = 50;
+    uint8_t *sequence[SEQUENCE_FRAMES];
+    unsigned int t;
+    size_t i;
+
+    for (;;)
+    {
+        int index;
+        int c;
+
+        c = getopt_long(argc, argv, short_options, long_options, &index);
+
+        if (-1 == c)
+            break;
+
+        switch (c)
+        {
+        case 'h':
+            usage(stdout, argv);
+            exit(EXIT_SUCCESS);
+
+        case 'x':
+            width = atoi(optarg);
+            break;
+
+        case 'y':
+            height = atoi(optarg);
+            break;
+
+        case 'R':
+            recorded = optarg;
+            break;
+
+        case 'P':
+            baseline = optarg;
+            break;
+
+        case 'W':
+            new_baseline = optarg;
+            break;
+
+        case 'f':
+            frames = max(1, atoi(optarg));
+            break;
+
+        default:
+            usage(stderr, argv);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (width < 2 || (width & 1) || height < 2)
+    {
+        fprintf(stderr, "Need an even width and at least 2x2 pixels\n");
+        exit(EXIT_FAILURE);
+    }
+
+    line_bytes = width * 2;
+    stride = line_bytes + LINE_PADDING;
+
+    generate_YCbCr_to_RGB_lookup();
+
+    test_lookup();
+    test_denoise_line();
+
+    for (t = 0; t < SEQUENCE_FRAMES; t++)
+        sequence[t] = xmalloc(line_bytes * height);
+
+    /* Smooth, to keep the interpolation error of the deinterlacers typical. */
+    make_gradient(sequence[0]);
+    test_still("gradient", sequence[0]);
+
+    srand(1);
+    for (i = 0; i < line_bytes * height; i++)
+        sequence[0][i] = rand() & 0xff;
+    test_still("noise", sequence[0]);
+
+    /* Blocks at the ends of every range, so every clamp gets exercised. */
+    for (i = 0; i < line_bytes * height; i++)
+    {
+        size_t x = (i / 2) % width;
+        size_t y = (i / 2) / width;
+
+        sequence[0][i] = ((x / 8 + y / 8 + i % 4) & 1) ? 255 : 0;
+    }
+    test_still("extremes", sequence[0]);
+
+    for (t = 0; t < SEQUENCE_FRAMES; t++)
+        make_moving(sequence[t], t);
+    test_sequence("moving", sequence, SEQUENCE_FRAMES);
+
+    for (t = 0; t < SEQUENCE_FRAMES; t++)
+        make_changing(sequence[t], t);
+    test_sequence("changing", sequence, SEQUENCE_FRAMES);
+
+    for (t = 0; t < SEQUENCE_FRAMES; t++)
+        free(sequence[t]);
+
+    if (recorded)
+        test_recorded(recorded);
+
+    framestats_free();
+
+    if (baseline || new_baseline)
+    {
+        bench(frames);
+
+        if (baseline)
+            check_baseline(baseline);
+        if (new_baseline)
+            write_baseline(new_baseline);
+    }
+    else
+    {
+        printf("warn %-24s not checked, no --baseline given\n", "speed");
+    }
+
+    printf("%u failures\n", failures);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,363 @@
+/*
+ * Asynchronous still capture.
+ *
+ * Queued frames carry the wall clock time they were submitted at, which
+ * is also used for the file name, so a burst gets names in capture order
+ * no matter which encoder finishes first.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <sys/time.h>
+
+#include <png.h>
+#include <jpeglib.h>
+
+#include "snapshot.h"
+#include "util.h"
+
+struct snapshot_job
+{
+    uint8_t *rgb;
+    struct timeval tv;
+    unsigned long seq;
+};
+
+static size_t width;
+static size_t height;
+static snapshot_format format;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* Idle buffers, handed out in exchange for a queued frame. */
+static uint8_t **spare = NULL;
+static unsigned int n_spare = 0;
+
+/* FIFO of frames waiting for an encoder, n_slots long. */
+static struct snapshot_job *queue = NULL;
+static unsigned int n_slots = 0;
+static unsigned int head = 0;
+static unsigned int n_queued = 0;
+
+static pthread_t *threads = NULL;
+static unsigned int n_threads = 0;
+static int stopping = 0;
+
+static unsigned long seq = 0;
+static unsigned long dropped = 0;
+
+static const char *extensions[] = { "ppm", "png", "jpg" };
+
+int snapshot_parse_format(const char *name, snapshot_format * fmt)
+{
+    if (!strcmp(name, "ppm"))
+        *fmt = SNAPSHOT_PPM;
+    else if (!strcmp(name, "png"))
+        *fmt = SNAPSHOT_PNG;
+    else if (!strcmp(name, "jpg") || !strcmp(name, "jpeg"))
+        *fmt = SNAPSHOT_JPEG;
+    else
+        return -1;
+
+    return 0;
+}
+
+static int write_ppm(FILE * fp, const uint8_t * rgb)
+{
+    fprintf(fp, "P6\n%zu %zu\n255\n", width, height);
+
+    if (fwrite(rgb, width * 3, height, fp) != height)
+        return -1;
+
+    return 0;
+}
+
+static int write_png(FILE * fp, const uint8_t * rgb)
+{
+    png_structp png;
+    png_infop info;
+    size_t y;
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png)
+        return -1;
+
+    info = png_create_info_struct(png);
+    if (!info || setjmp(png_jmpbuf(png)))
+    {
+        png_destroy_write_struct(&png, &info);
+        return -1;
+    }
+
+    png_init_io(png, fp);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    for (y = 0; y < height; y++)
+        png_write_row(png, (png_const_bytep)(rgb + y * width * 3));
+
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+
+    return 0;
+}
+
+/* libjpeg's default error_exit exits the process, jump back to write_jpeg() instead. */
+struct jpeg_error
+{
+    struct jpeg_error_mgr mgr;
+    jmp_buf jmp;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    struct jpeg_error *err = (struct jpeg_error *)cinfo->err;
+
+    (*cinfo->err->output_message) (cinfo);
+    longjmp(err->jmp, 1);
+}
+
+static int write_jpeg(FILE * fp, const uint8_t * rgb)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error jerr;
+    JSAMPROW row;
+
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = jpeg_error_exit;
+
+    if (setjmp(jerr.jmp))
+    {
+        jpeg_destroy_compress(&cinfo);
+        return -1;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fp);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 90, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        row = (JSAMPROW)(rgb + cinfo.next_scanline * width * 3);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    return 0;
+}
+
+static void encode(const struct snapshot_job *job)
+{
+    char name[64];
+    char tmp[68];
+    struct tm tm;
+    FILE *fp;
+    size_t n;
+    int r = -1;
+
+    localtime_r(&job->tv.tv_sec, &tm);
+    n = strftime(name, sizeof(name), "snapshot-%Y%m%d-%H%M%S", &tm);
+    snprintf(name + n, sizeof(name) - n, ".%06ld-%04lu.%s",
+             (long)job->tv.tv_usec, job->seq, extensions[format]);
+
+    /* Write under a temporary name so watchers never see a partial file. */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+
+    fp = fopen(tmp, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n", tmp, errno, strerror(errno));
+        return;
+    }
+
+    switch (format)
+    {
+    case SNAPSHOT_PPM:
+        r = write_ppm(fp, job->rgb);
+        break;
+
+    case SNAPSHOT_PNG:
+        r = write_png(fp, job->rgb);
+        break;
+
+    case SNAPSHOT_JPEG:
+        r = write_jpeg(fp, job->rgb);
+        break;
+    }
+
+    if (fclose(fp) || r)
+    {
+        fprintf(stderr, "Cannot write '%s'\n", tmp);
+        remove(tmp);
+        return;
+    }
+
+    if (rename(tmp, name))
+        fprintf(stderr, "Cannot rename '%s': %d, %s\n", tmp, errno, strerror(errno));
+}
+
+static void *encoder_thread(void *arg)
+{
+    struct snapshot_job job;
+
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+
+    for (;;)
+    {
+        while (!n_queued && !stopping)
+            pthread_cond_wait(&cond, &lock);
+
+        if (!n_queued)
+            break;
+
+        job = queue[head];
+        head = (head + 1) % n_slots;
+        n_queued--;
+
+        pthread_mutex_unlock(&lock);
+        encode(&job);
+        pthread_mutex_lock(&lock);
+
+        spare[n_spare++] = job.rgb;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+int snapshot_init(size_t w, size_t h, snapshot_format fmt,
+                  unsigned int slots, unsigned int workers)
+{
+    width = w;
+    height = h;
+    format = fmt;
+    n_slots = slots;
+
+    spare = calloc(n_slots, sizeof(*spare));
+    queue = calloc(n_slots, sizeof(*queue));
+    threads = calloc(workers, sizeof(*threads));
+
+    if (!spare || !queue || !threads)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (n_spare = 0; n_spare < n_slots; n_spare++)
+    {
+        spare[n_spare] = malloc(width * height * 3);
+
+        if (!spare[n_spare])
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (n_threads = 0; n_threads < workers; n_threads++)
+        if (start_worker(&threads[n_threads], encoder_thread, NULL))
+            break;
+
+    if (!n_threads)
+    {
+        fprintf(stderr, "Cannot start snapshot encoder\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+uint8_t *snapshot_submit(uint8_t * rgb)
+{
+    struct snapshot_job *job;
+    uint8_t *next;
+
+    pthread_mutex_lock(&lock);
+
+    if (!n_spare)
+    {
+        dropped++;
+        pthread_mutex_unlock(&lock);
+        return rgb;
+    }
+
+    next = spare[--n_spare];
+
+    job = &queue[(head + n_queued) % n_slots];
+    job->rgb = rgb;
+    job->seq = seq++;
+    gettimeofday(&job->tv, NULL);
+    n_queued++;
+
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+
+    return next;
+}
+
+unsigned long snapshot_dropped(void)
+{
+    unsigned long n;
+
+    pthread_mutex_lock(&lock);
+    n = dropped;
+    pthread_mutex_unlock(&lock);
+
+    return n;
+}
+
+void snapshot_shutdown(void)
+{
+    unsigned int i;
+
+    if (!threads)
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < n_spare; i++)
+        free(spare[i]);
+
+    free(spare);
+    free(queue);
+    free(threads);
+
+    spare = NULL;
+    queue = NULL;
+    threads = NULL;
+    n_spare = 0;
+    n_threads = 0;
+    n_queued = 0;
+    head = 0;
+    stopping = 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * Asynchronous still capture.
+ *
+ * The viewer hands over the RGB frame it just converted and gets an idle
+ * buffer of the same size back to convert the next frame into, so taking a
+ * snapshot costs a pointer swap on the capture path. Encoding and disk I/O
+ * happen on a small pool of worker threads.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    SNAPSHOT_PPM,
+    SNAPSHOT_PNG,
+    SNAPSHOT_JPEG,
+} snapshot_format;
+
+/* Parses "ppm", "png", "jpg"/"jpeg". Returns -1 if unknown. */
+int snapshot_parse_format(const char *name, snapshot_format * fmt);
+
+/*
+ * Allocates n_slots spare frames of width x height 24 bit RGB and starts
+ * n_threads encoders. Returns 0 on success.
+ */
+int snapshot_init(size_t width, size_t height, snapshot_format fmt,
+                  unsigned int n_slots, unsigned int n_threads);
+
+/*
+ * Queues rgb for encoding and returns the buffer the caller should use
+ * from now on. If every slot is busy the frame is dropped and rgb itself
+ * is returned. Ownership of the buffers moves between caller and pool, all
+ * of them come from malloc().
+ */
+uint8_t *snapshot_submit(uint8_t * rgb);
+
+/* Number of frames dropped because the encoders fell behind. */
+unsigned long snapshot_dropped(void);
+
+/* Writes out everything still queued, stops the encoders and frees the pool. */
+void snapshot_shutdown(void);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * Small helpers shared by the capture library, the viewer and the self test.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "util.h"
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int start_worker(pthread_t * thread, void *(*fn) (void *), void *arg)
+{
+    sigset_t all;
+    sigset_t old;
+    int r;
+
+    /* The new thread inherits the mask in force while it is created. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    r = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return r;
+}
@@ -0,0 +1,21 @@
+/*
+ * Small helpers shared by the capture library, the viewer and the self test.
+ */
+
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* CLOCK_MONOTONIC in nanoseconds. */
+uint64_t now_ns(void);
+
+/*
+ * pthread_create() with every signal blocked in the new thread, so
+ * SIGUSR1/SIGUSR2 triggers always reach the thread that installed the
+ * handlers. Returns 0 or the pthread_create() error.
+ */
+int start_worker(pthread_t * thread, void *(*fn) (void *), void *arg);
+
+#endif